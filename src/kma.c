@@ -50,6 +50,14 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
 
 /************Private include**********************************************/
 #include "kma_page.h"
@@ -89,6 +97,9 @@ void usage();
 void error(char*, char*);
 void pass();
 void fail();
+int openTlbCounter();
+long long readTlbCounter(int);
+void printLatency(char*, unsigned long long*);
 
 /************External Declaration*****************************************/
 
@@ -102,6 +113,8 @@ int currentAllocBytes = 0;
 
 char *name = NULL;
 
+long firstAllocLatency = -1;
+
 int
 main(int argc, char* argv[])
 {
@@ -118,19 +131,24 @@ main(int argc, char* argv[])
 
   int n_req = 0, n_alloc=0, n_dealloc=0;
   kma_page_stat_t* stat;
+  kma_page_detail_t* details;
 
 #ifdef COMPETITION
   double ratioSum = 0.0;
+  double residentRatioSum = 0.0;
   int ratioCount = 0;
 #endif
   
 #ifndef COMPETITION
+  long spreadSum = 0, inUseSum = 0;
+  int spread, peakSpread = 0, spreadCount = 0;
+
   FILE* allocTrace = fopen("kma_output.dat", "w");
   if (allocTrace == NULL)
     {
       error("unable to open allocation output file", "kma_output.dat");
     }
-  fprintf(allocTrace, "0 0 0\n");
+  fprintf(allocTrace, "0 0 0 0\n");
 #endif
 
   if (argc != 2)
@@ -156,6 +174,9 @@ main(int argc, char* argv[])
   char command[16];
   int req_id, req_size, index = 1;
 
+  // Count the dTLB misses of replaying the trace, if the system lets us
+  int tlbCounter = openTlbCounter();
+
   // Parse the lines in the file, and call allocate or
   // deallocate accordingly.
   while (fscanf(f_test, "%10s", command) == 1)
@@ -188,7 +209,21 @@ main(int argc, char* argv[])
 
       stat = page_stats();
       int totalBytes = stat->num_in_use * stat->page_size;
+      int residentBytes = stat->num_resident * stat->page_size;
 
+#ifndef COMPETITION
+      // Track how far apart the pages in use are. This walks the page
+      // pool, so it is left out of the timed competition runs.
+      spread = page_spread();
+      if (stat->num_in_use > 0)
+	{
+	  spreadSum += spread;
+	  inUseSum += stat->num_in_use;
+	  spreadCount += 1;
+	  if (spread > peakSpread)
+	    peakSpread = spread;
+	}
+#endif
 
 #ifdef COMPETITION
     if(req_id < n_req && n_alloc != n_dealloc)
@@ -198,11 +233,16 @@ main(int argc, char* argv[])
 	  int wastedBytes = totalBytes - currentAllocBytes;
 	  ratioSum += ((double) wastedBytes) / currentAllocBytes;
 	  ratioCount += 1;
+
+	  // The same ratio counting the free pages still resident
+	  wastedBytes = residentBytes - currentAllocBytes;
+	  residentRatioSum += ((double) wastedBytes) / currentAllocBytes;
 	}
 #endif
 
 #ifndef COMPETITION
-      fprintf(allocTrace, "%d %d %d\n", index, currentAllocBytes, totalBytes);
+      fprintf(allocTrace, "%d %d %d %d\n", index, currentAllocBytes, totalBytes,
+	      residentBytes);
 #endif
       
       index += 1;
@@ -218,6 +258,38 @@ main(int argc, char* argv[])
   printf("Page Requested/Freed/In Use: %5d/%5d/%5d\n",
 	 stat->num_requested, stat->num_freed, stat->num_in_use);	
   
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  printf("Pool rebuilds: %d\n", stat->num_rebuilds);
+  printf("Page Resident/Committed: %5d/%5d\n",
+	 stat->num_resident, stat->num_committed);
+  printf("First allocation latency: %ld ns\n", firstAllocLatency);
+  printf("Peak resident memory: %ld KB\n", usage.ru_maxrss);
+#ifndef COMPETITION
+  if (spreadCount > 0)
+    {
+      printf("Page spread average/peak: %ld/%d (in use average: %ld)\n",
+	     spreadSum / spreadCount, peakSpread, inUseSum / spreadCount);
+    }
+#endif
+  
+  if (tlbCounter >= 0)
+    {
+      printf("dTLB load misses: %lld\n", readTlbCounter(tlbCounter));
+    }
+  else
+    {
+      printf("dTLB load misses: unavailable\n");
+    }
+  
+  details = page_details();
+  if (details->enabled)
+    {
+      printf("Peak pages in use: %d\n", details->peak_in_use);
+      printLatency("get_page", details->get_latency);
+      printLatency("free_page", details->free_latency);
+    }
+  
   if (stat->num_requested != stat->num_freed || stat->num_in_use != 0)
     {
       error("not all pages freed", "");
@@ -230,6 +302,7 @@ main(int argc, char* argv[])
 
 #ifdef COMPETITION
   printf("Competition average ratio: %f\n", ratioSum / ratioCount);
+  printf("Competition resident ratio: %f\n", residentRatioSum / ratioCount);
 #endif
   
   pass();
@@ -270,11 +343,27 @@ allocate(mem_t* requests, int req_id, int req_size)
   assert(new->state == FREE);
   
   new->size = req_size;
-  new->ptr = kma_malloc(new->size);
   
-  // Accept a NULL response in some cases... 
-  if(!(((new->ptr != NULL) && (new->size <= (PAGESIZE - sizeof(void*))))
-       || ((new->ptr == NULL) && (new->size > (PAGESIZE - sizeof(void*))))))
+  if (firstAllocLatency < 0)
+    {
+      // Time the first allocation, which pays for setting up the pool
+      struct timespec start, end;
+      
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      new->ptr = kma_malloc(new->size);
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      
+      firstAllocLatency = (end.tv_sec - start.tv_sec) * 1000000000L
+	+ (end.tv_nsec - start.tv_nsec);
+    }
+  else
+    {
+      new->ptr = kma_malloc(new->size);
+    }
+  
+  // Accept a NULL response only for requests that do not fit in a
+  // page, which an algorithm may serve from a span of pages or refuse
+  if ((new->ptr == NULL) && (new->size <= (PAGESIZE - sizeof(void*))))
     {
       error("got NULL from kma_malloc for alloc'able request", "");
     }
@@ -357,3 +446,66 @@ check(char* lhs, char* rhs, int size)
 	}
     }
 }
+
+int
+openTlbCounter()
+{
+#ifdef __linux__
+  struct perf_event_attr attr;
+  int fd;
+  
+  memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_HW_CACHE;
+  attr.size = sizeof(attr);
+  attr.config = PERF_COUNT_HW_CACHE_DTLB
+    | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+    | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  
+  fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+  if (fd >= 0)
+    {
+      ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+      ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+  
+  return fd;
+#else
+  return -1;
+#endif
+}
+
+long long
+readTlbCounter(int fd)
+{
+  long long count = -1;
+  
+#ifdef __linux__
+  ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+  if (read(fd, &count, sizeof(count)) != sizeof(count))
+    {
+      count = -1;
+    }
+  close(fd);
+#endif
+  
+  return count;
+}
+
+void
+printLatency(char* call, unsigned long long* histogram)
+{
+  int i;
+  
+  printf("%s latency (cycles):\n", call);
+  for (i = 0; i < LATENCY_BUCKETS; i++)
+    {
+      if (histogram[i] > 0)
+        {
+          printf("  [%10llu, %10llu): %llu\n", 1ULL << i, 2ULL << i,
+                 histogram[i]);
+        }
+    }
+}
@@ -0,0 +1,128 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator Benchmark
+ * -------------------------------------------------------------------------
+ *    Purpose: Time malloc/free pairs of an allocator for every size class
+ *    Author: Stefan Birrer
+ *    Copyright: 2004 Northwestern University
+ ***************************************************************************/
+/***************************************************************************
+ *  ChangeLog:
+ * -------------------------------------------------------------------------
+ *    Revision 1.1  2026/10/17
+ *    - initial version, built with make bench
+ *
+ ***************************************************************************/
+#define __KMA_BENCH_IMPL__
+
+/************System include***********************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+/************Private include**********************************************/
+#include "kma_page.h"
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+#ifndef NUMROUNDS
+#define NUMROUNDS 20000
+#endif
+
+/* The number of buffers allocated before they are all freed again */
+#define BATCH 64
+
+/* The number of times a size is timed, keeping the fastest */
+#define TRIES 5
+
+/************Global Variables*********************************************/
+
+/************Function Prototypes******************************************/
+double timePairs(kma_size_t);
+long clockNs();
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+int
+main(int argc, char* argv[])
+{
+  kma_size_t size;
+  double ns, best;
+  int i;
+
+  printf("%10s %14s\n", "size", "ns/pair");
+
+  /* One size per power of two class, the largest request it holds */
+  for (size = 16; size <= PAGESIZE; size = 2 * size)
+    {
+      best = -1;
+      for (i = 0; i < TRIES; i++)
+        {
+          ns = timePairs(size);
+          if (best < 0 || ns < best)
+            {
+              best = ns;
+            }
+        }
+      printf("%10d %14.1f\n", size, best);
+    }
+
+  return EXIT_SUCCESS;
+}
+
+double
+timePairs(kma_size_t size)
+{
+  void* held;
+  void* buffers[BATCH];
+  long start;
+  int round, i;
+
+  /* Keep one buffer of the size, so that its pages stay around */
+  held = kma_malloc(size);
+  if (held == NULL)
+    {
+      error("unable to allocate", "");
+    }
+
+  start = clockNs();
+  for (round = 0; round < NUMROUNDS; round++)
+    {
+      for (i = 0; i < BATCH; i++)
+        {
+          buffers[i] = kma_malloc(size);
+        }
+      for (i = BATCH - 1; i >= 0; i--)
+        {
+          kma_free(buffers[i], size);
+        }
+    }
+  start = clockNs() - start;
+
+  kma_free(held, size);
+
+  return (double)start / ((double)NUMROUNDS * BATCH);
+}
+
+long
+clockNs()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+void
+error(char* message, char* arg)
+{
+  fprintf(stderr, "ERROR: %s: %s.\n", message, arg);
+  exit(EXIT_FAILURE);
+}
@@ -43,6 +43,13 @@
 /************Private include**********************************************/
 #include "kma_page.h"
 #include "kma.h"
+#ifdef BUD_TUNING
+/* The block sizes picked for a workload by make tune, e.g. built with
+ * KMAFLAGS=-DBUD_TUNING=kma_bud_tuned.h */
+#define TUNING_STR(x) #x
+#define TUNING_HEADER(x) TUNING_STR(x)
+#include TUNING_HEADER(BUD_TUNING)
+#endif
 
 /************Defines and Typedefs*****************************************/
 /*  #defines and typedefs should have their names in all caps.
@@ -51,10 +58,70 @@
  *  structures and arrays, line everything up in neat columns.
  */
 /* The minimal buffer size */
+#ifndef MINBUFSIZE
 #define MINBUFSIZE 64
+#endif
+/* The largest block served from a shared page. Larger requests get a
+ * page of their own, or a span. */
+#ifndef MAXBUFSIZE
+#define MAXBUFSIZE (PAGESIZE / 2)
+#endif
+
+#if (MINBUFSIZE & (MINBUFSIZE - 1)) || (MAXBUFSIZE & (MAXBUFSIZE - 1))
+#error "MINBUFSIZE and MAXBUFSIZE must be powers of two"
+#endif
+#if MINBUFSIZE < 16 || MINBUFSIZE > MAXBUFSIZE || MAXBUFSIZE > PAGESIZE / 2
+#error "MINBUFSIZE must be at least 16 and MAXBUFSIZE at most half a page"
+#endif
 /* The number of minimal buffers in each page */
 #define NUMBEROFBUF PAGESIZE / MINBUFSIZE
 
+/* How the buddy tree of a page is kept:
+ * BUD_TREE: the largest free block under every node
+ * BUD_BITMAP: a bit for every node that is a free block. The free
+ *             blocks of a size are found with find-first-set on their
+ *             level of the bitmap.
+ * BUD_POOL: a bit for every node that is a free block, with the free
+ *           blocks of all pages on one list per size. A buddy is found
+ *           by flipping the size bit of the offset, and whole pages and
+ *           spans are coalesced by the page allocator. */
+#define BUD_TREE 0
+#define BUD_BITMAP 1
+#define BUD_POOL 2
+
+#ifndef BUD_LAYOUT
+#define BUD_LAYOUT BUD_TREE
+#endif
+
+/* The number of whole pages kept for requests larger than MAXBUFSIZE
+ * that fit in a page, so that they are reused without going back to
+ * the page allocator. The cached pages count as waste, so it is off
+ * unless set, e.g. to 8. */
+#ifndef LARGE_CACHE_PAGES
+#define LARGE_CACHE_PAGES 0
+#endif
+
+/* Test if the give size is power of 2 */
+#define IS_TWO_POWER(x) (!((x) & ((x) - 1)))
+/* Calculate the larger number of x and y*/
+#define LARGER(x, y) ((x) > (y) ? (x) : (y))
+
+/* The number of page lists, one for every order of the largest free
+ * block in a page */
+#define NUMORDERS 32
+/* Calculate the order of a non-zero length, rounding down */
+#define ORDER(x) (31 - __builtin_clz(x))
+/* Mark a page that sits in no page list */
+#define NO_ORDER 0xff
+
+#if BUD_LAYOUT == BUD_TREE
+/* The type of a node in the tree, which has to hold the page size */
+#if PAGESIZE <= 32768
+typedef uint16_t length_t;
+#else
+typedef uint32_t length_t;
+#endif
+
 /* Calculte the index of the children and parent nodes */
 #define LEFT_CHILD(n) ((n) * 2 + 1)
 #define RIGHT_CHILD(n) ((n) * 2 + 2)
@@ -62,297 +129,445 @@
 
 /* Calculte the offset within the page for given index */
 #define OFFSET(n, size) (((n) + 1) * (size) - PAGESIZE)
-/* Test if the give size is power of 2 */
-#define IS_TWO_POWER(x) (!((x) & ((x) - 1)))
-/* Calculate the mod of x w.r.t. 2^n */
-#define MOD(x, n) ((x) & ((n) - 1))
-/* Calculate the larger number of x and y*/
-#define LARGER(x, y) ((x) > (y) ? (x) : (y))
 
-/* The header in each page:
- * kma_page_t* next_page: pointer to next page
- * kma_page_t* prev_page: pointer to previous page
- * uint8_t large: mark the page that is large enough to include the header and the request mem
- * uint16_t longest_length: an array containing the available space in each node */
+/* The metadata of each page:
+ * kma_page_t* next_page: pointer to next page in its page list
+ * kma_page_t* prev_page: pointer to previous page in its page list
+ * uint8_t order: the page list the page is in, the order of its largest free block
+ * length_t longest_length: an array containing the available space in each node */
 typedef struct {
   kma_page_t* next_page;
   kma_page_t* prev_page;
-  uint8_t large;
-  uint16_t longest_length[2 * NUMBEROFBUF - 1];
-} page_header_t;
+  uint8_t order;
+  length_t longest_length[2 * NUMBEROFBUF - 1];
+} page_meta_t;
+
+/* The largest free block of a page */
+#define LONGEST(m) ((m)->longest_length[0])
+#else
+/* The number of words in the node bitmap, whose nodes are numbered
+ * from 1 at the root, so that each level starts at a power of two */
+#define MAPWORDS ((2 * NUMBEROFBUF + 63) / 64)
+
+/* Test, set and clear the free bit of a node */
+#define TEST_NODE(m, n) ((m)->free_nodes[(n) / 64] & (1ULL << ((n) % 64)))
+#define SET_NODE(m, n) ((m)->free_nodes[(n) / 64] |= (1ULL << ((n) % 64)))
+#define CLEAR_NODE(m, n) ((m)->free_nodes[(n) / 64] &= ~(1ULL << ((n) % 64)))
+
+#if BUD_LAYOUT == BUD_BITMAP
+/* The metadata of each page:
+ * kma_page_t* next_page: pointer to next page in its page list
+ * kma_page_t* prev_page: pointer to previous page in its page list
+ * uint8_t order: the page list the page is in, the order of its largest free block
+ * uint16_t used: the number of blocks allocated from the page
+ * uint64_t free_nodes: the bitmap of the free blocks */
+typedef struct {
+  kma_page_t* next_page;
+  kma_page_t* prev_page;
+  uint8_t order;
+  uint16_t used;
+  uint64_t free_nodes[MAPWORDS];
+} page_meta_t;
+
+/* The largest free block of a page */
+#define LONGEST(m) largest_block(m)
+#else
+/* Calculate the node of the block of a size at an offset */
+#define NODE(size, offset) (PAGESIZE / (size) + (offset) / (size))
+
+/* The metadata of each page:
+ * uint64_t free_nodes: the bitmap of the free blocks. It is all clear
+ *                      while the page is in use as a whole or not used */
+typedef struct {
+  uint64_t free_nodes[MAPWORDS];
+} page_meta_t;
+
+/* A free block, linked into the list of its size */
+typedef struct buddy {
+  struct buddy* next;
+  struct buddy* prev;
+} buddy_t;
+#endif
+#endif
+
+/* The metadata of a page, kept out of the page so that all of it can
+ * be handed out and every block is aligned to its size */
+#define META(page) ((page_meta_t*)page_entry(&page_meta, (page)->ptr))
 
 /************Global Variables*********************************************/
-kma_page_t* first_page = NULL;
+/* The metadata of the pages, indexed by META */
+static kma_side_table_t page_meta = SIDE_TABLE(page_meta_t);
+
+#if BUD_LAYOUT == BUD_POOL
+/* The free blocks, listed by their order, and a bitmap of the orders
+ * that have blocks */
+buddy_t* free_lists[NUMORDERS];
+#else
+/* The pages with free space, listed by the order of their largest free
+ * block, and a bitmap of the orders that have pages */
+kma_page_t* page_lists[NUMORDERS];
+#endif
+unsigned int nonempty_orders = 0;
+
+/* The cached whole pages, used as a stack */
+kma_page_t* large_cache[LARGE_CACHE_PAGES + 1];
+int large_cached = 0;
 
 /************Function Prototypes******************************************/
 
-/* Initialize the header of the page */
-void init_header(kma_page_t*, kma_page_t*);
+#if BUD_LAYOUT == BUD_POOL
+/* Take a free block of the given size, splitting a larger one */
+void* take_block(unsigned int);
+/* Give a block of the given size back, coalescing it with its buddies */
+void give_block(kma_page_t*, void*, unsigned int);
+/* Add a free block to and take it off the list of its size */
+void push_block(void*, unsigned int);
+void unlink_block(buddy_t*, unsigned int);
+#else
+/* Initialize the metadata of the page */
+void init_meta(kma_page_t*);
 /* Find the page that is suitable for the allocation */
 kma_page_t* find_alloc_page(kma_size_t);
-/* Find the page that contains the memory to free */
-kma_page_t* find_free_page(void*);
-/* Remove a page from the link list */
+/* Remove a page from its page list and free it */
 void remove_page(kma_page_t*);
-
-/* Round up the given size to 2^n */
-static unsigned int round_size(unsigned int);
-/* Find the real size of a node due to the header offset */
-unsigned int real_size(unsigned int, unsigned int);
+/* Add a page to and take it off the list of its order */
+void link_page(kma_page_t*);
+void unlink_page(kma_page_t*);
+/* Move a page to the list of the order of its largest free block */
+void update_page(kma_page_t*);
+
+/* Allocate a block of the given size in a page with room for it and
+ * return its offset */
+unsigned int alloc_block(page_meta_t*, kma_size_t);
+/* Free the block of the given size at an offset, and tell whether the
+ * page is empty afterwards */
+bool free_block(page_meta_t*, unsigned int, kma_size_t);
+#endif
+
+/* Take a whole page from the cache, and give one back to it */
+kma_page_t* get_large_page();
+void put_large_page(kma_page_t*);
+/* Free the cached pages once nothing else is in use */
+void drain_large_cache();
+
+/* Round up the given size to a block size */
+static unsigned int block_size(unsigned int);
+#if BUD_LAYOUT == BUD_BITMAP
+/* Find the first free node on a level of the tree, or 0 */
+unsigned int find_node(page_meta_t*, unsigned int);
+/* Find the size of the largest free block, or 0 */
+unsigned int largest_block(page_meta_t*);
+#endif
 	
 /************External Declaration*****************************************/
 
 /**************Implementation***********************************************/
 
-void
-init_header(kma_page_t* page, kma_page_t* prev_page)
+void*
+kma_malloc(kma_size_t size)
 {
-  unsigned int i, node_size = 2 * PAGESIZE;
-  unsigned int offset, pre_filled_offset;
-  int effective_length;
+  kma_page_t* page;
+#if BUD_LAYOUT != BUD_POOL
+  unsigned int offset;
+#endif
 
-  /* Fill the header to the page */
-  page_header_t* page_header;
-  page_header = (page_header_t*)(page->ptr);
+  /* A request of more than half a page would leave the rest of its
+   * page unused, so give it the page, or a span if it needs more */
+  if (size > MAXBUFSIZE)
+  {
+    page = size > PAGESIZE ? get_pages(NUMPAGES(size)) : get_large_page();
+    return page == NULL ? NULL : page->ptr;
+  }
 
-  /* This new page will be in the end of the page list */
-  page_header->prev_page = prev_page;
-  page_header->next_page = NULL;
+#if BUD_LAYOUT == BUD_POOL
+  return take_block(block_size(size));
+#else
+  /* Find proper page to allocate the mem */
+  page = find_alloc_page(size);
+  if (page == NULL)
+    return NULL;
 
-  /* Intially assume the page is large enough. Will change
-   * the value of ->large later */
-  page_header->large = 0;
+  offset = alloc_block(META(page), size);
+  update_page(page);
 
-  /* The page is pre-filled by the header which needs to be
-   * avoided during allocation */
-  pre_filled_offset = sizeof(page_header_t);
+  return page->ptr + offset;
+#endif
+}
 
-  /* Initialize the longest_length array */
-  for (i = 0; i < 2 * NUMBEROFBUF - 1; i++)
+void 
+kma_free(void* ptr, kma_size_t size)
+{
+  kma_page_t* page = page_lookup(ptr);
+
+  /* Whole pages and spans go straight back to the page allocator */
+  if (size > MAXBUFSIZE)
   {
-    if (IS_TWO_POWER(i + 1)) node_size = node_size / 2;
-    
-    /* If the node has intersection with the header, we need
-     * to adjust its available space to effective_length*/
-    offset = OFFSET(i, node_size);
-    if (offset < pre_filled_offset)
-    {
-      effective_length = offset + node_size - pre_filled_offset;
-      page_header->longest_length[i] = effective_length > 0 ? effective_length : 0;
-    } else
-      page_header->longest_length[i] = node_size;
+    if (page->size > PAGESIZE)
+      free_pages(page);
+    else
+      put_large_page(page);
+    drain_large_cache();
+    return;
   }
+
+#if BUD_LAYOUT == BUD_POOL
+  give_block(page, ptr, block_size(size));
+#else
+  /* If the page is empty, remove and free it. */
+  if (free_block(META(page), ptr - page->ptr, size))
+    remove_page(page);
+  else
+    update_page(page);
+#endif
 }
 
+#if BUD_LAYOUT == BUD_POOL
 void*
-kma_malloc(kma_size_t size)
+take_block(unsigned int power_size)
 {
-  unsigned int node_size;
-  unsigned int power_size;
-  unsigned int offset;
-  unsigned int index = 0; 
-
   kma_page_t* page;
-  page_header_t* page_header;
-
-  /* Find proper page to allocate the mem */
-  page = find_alloc_page(size);
-  if (page == NULL)
-    return NULL;
-  else
+  page_meta_t* meta;
+  buddy_t* block;
+  unsigned int orders, node, size;
+
+  /* Take the smallest free block that is large enough, or else a new
+   * page, which is a free block of the page order */
+  orders = nonempty_orders & ~((1U << ORDER(power_size)) - 1);
+  if (orders != 0)
   {
-    page_header = page->ptr;
-    if ((size + sizeof(page_header_t)) > PAGESIZE)
-    {
-      /* If the page is not large enough to contain the header and
-       * the requested mem, abandon the longest_length and only use
-       * the prev, next and larger in the header */
-      page_header->large = 1;
-      return (void*)(page->ptr) + 2 * sizeof(kma_page_t*) + sizeof(uint8_t);
-    }
+    size = 1U << __builtin_ctz(orders);
+    block = free_lists[ORDER(size)];
+    unlink_block(block, size);
+    page = page_lookup(block);
+    meta = META(page);
+    node = NODE(size, (void*)block - page->ptr);
+    CLEAR_NODE(meta, node);
   }
-
-  /* Roundup the size if it is not power of 2 */
-  if (!IS_TWO_POWER(size))
-    power_size = round_size((unsigned int)size);
   else
-    power_size = size;
-  
-  /* If the round-up value is less than minimal buffer size, set it
-   * to the minimal buffer size */
-  if (power_size < MINBUFSIZE)
-    power_size = MINBUFSIZE;
-
-  /* Traverse the tree to find proper node index to fill */
-  for (node_size = PAGESIZE; node_size != power_size; node_size /= 2)
   {
-    /* It has been guaranteed that there is enough space in the page when
-     * calling find_alloc_page(). So we just need to find out the child
-     * node with proper size that has enough space. */
-    if (page_header->longest_length[LEFT_CHILD(index)] >= size)
-      index = LEFT_CHILD(index);
-    else
-      index = RIGHT_CHILD(index);
+    page = get_page();
+    if (page == NULL)
+      return NULL;
+    meta = META(page);
+    block = page->ptr;
+    size = PAGESIZE;
+    node = 1;
   }
 
-  /* Calculate the offset value the index we have just found */
-  offset = OFFSET(index, node_size) + node_size - page_header->longest_length[index];
-  /* Set the available space of this node to be zero*/
-  page_header->longest_length[index] = 0;
-
-  /* Traverse back to the parent node such that the available
-   * space is updated */
-  while (index)
+  /* Split it down to the size, freeing the right half each time */
+  while (size > power_size)
   {
-    index = PARENT(index);
-    page_header->longest_length[index] = LARGER(page_header->longest_length[LEFT_CHILD(index)],
-                                                page_header->longest_length[RIGHT_CHILD(index)]);
+    size = size / 2;
+    node = node * 2;
+    SET_NODE(meta, node + 1);
+    push_block((void*)block + size, size);
   }
 
-  return page->ptr + offset;
+  return block;
 }
 
-void 
-kma_free(void* ptr, kma_size_t size)
+void
+give_block(kma_page_t* page, void* ptr, unsigned int size)
 {
-  kma_page_t* page = find_free_page(ptr);
-  page_header_t* page_header = page->ptr;
-  unsigned int left_length, right_length;
-  unsigned int node_size, index = 0;
-  unsigned int offset;
+  page_meta_t* meta = META(page);
+  unsigned int offset = ptr - page->ptr;
+  unsigned int node = NODE(size, offset);
 
-  /* If the page is marked as large, then it only holds 
-   * just one chunk of mem that need to be free. Thus
-   * just remove the page */
-  if (page_header->large == 1)
+  /* Coalesce with the buddy for as long as it is free. The buddy
+   * differs from the block only in the bit of their size. */
+  for (; node > 1 && TEST_NODE(meta, node ^ 1); node = node / 2)
   {
-    remove_page(page);
+    CLEAR_NODE(meta, node ^ 1);
+    unlink_block(page->ptr + (offset ^ size), size);
+    offset = offset & ~size;
+    size = size * 2;
+  }
+
+  /* A page that is free as a whole goes back to the page allocator.
+   * Giving it back as a span puts it in the free map whatever the
+   * PAGE_REUSE policy, where it merges with the free pages around it
+   * instead of waiting on the free stack. */
+  if (node == 1)
+  {
+    free_pages(page);
+    drain_large_cache();
     return;
   }
-  
-  /* Find the offset of the given pointer. Round up the begin offset of
-   * the memory since it may have overlap with the header */
-  node_size = MINBUFSIZE;
-  offset = ptr - page->ptr;
-  if (MOD(offset, MINBUFSIZE) != 0)
-    offset = offset - MOD(offset, MINBUFSIZE);
 
-  index = (offset + PAGESIZE) / node_size - 1;
+  SET_NODE(meta, node);
+  push_block(page->ptr + offset, size);
+}
 
-  /* Traverse the tree from bottom up. If we find a node that is not free
-   * with proper size, we stop */
-  for (; page_header->longest_length[index] != 0; index = PARENT(index))
-    node_size = node_size * 2;
+void
+push_block(void* ptr, unsigned int size)
+{
+  buddy_t* block = ptr;
+  unsigned int order = ORDER(size);
+
+  block->prev = NULL;
+  block->next = free_lists[order];
+  if (free_lists[order] != NULL)
+    free_lists[order]->prev = block;
+  free_lists[order] = block;
+  nonempty_orders |= 1U << order;
+}
 
-  /* Calculate the real available space in the node */
-  page_header->longest_length[index] = (uint16_t)real_size(index, node_size);
+void
+unlink_block(buddy_t* block, unsigned int size)
+{
+  unsigned int order = ORDER(size);
 
-  /* Traverse the tree top down to update the free node */
-  while (index)
-  {
-    index = PARENT(index);
-    node_size = node_size * 2;
-    left_length = page_header->longest_length[LEFT_CHILD(index)];
-    right_length = page_header->longest_length[RIGHT_CHILD(index)];
+  /* Link the prev and next blocks together */
+  if (block->prev != NULL)
+    block->prev->next = block->next;
+  else
+    free_lists[order] = block->next;
 
-    /* If the sum of the available space in the children nodes equals 
-     * the available space in the parent node, coalesce them. */
-    if (left_length + right_length == real_size(index, node_size))
-      page_header->longest_length[index] = (uint16_t)real_size(index, node_size);
-    else
-      page_header->longest_length[index] = LARGER(left_length, right_length);
-  }
+  if (block->next != NULL)
+    block->next->prev = block->prev;
 
-  /* If the page is empty, remove and free it. */
-  if (page_header->longest_length[0] == (PAGESIZE - sizeof(page_header_t)))
-    remove_page(page);
+  if (free_lists[order] == NULL)
+    nonempty_orders &= ~(1U << order);
 }
+#else
 
 kma_page_t*
 find_alloc_page(kma_size_t size)
 {
-  kma_page_t* page = first_page;
-  page_header_t* page_header;
+  kma_page_t* page;
+  unsigned int orders;
 
   /* If the requested size is too large, return NULL */
-  if ((size + 2 * sizeof(kma_page_t*) + sizeof(uint8_t)) > PAGESIZE)
+  if (size > MAXBUFSIZE)
     return NULL;
 
-  /* If there is not first_page existing, request one */
+  /* The blocks are powers of two, so every page listed at the order of
+   * the rounded up size or above has a free block large enough, so
+   * take the first one */
+  orders = nonempty_orders & ~((1U << ORDER(block_size(size))) - 1);
+  if (orders != 0)
+    return page_lists[__builtin_ctz(orders)];
+
+  /* Otherwise request a new page and list it */
+  page = get_page();
   if (page == NULL)
-  {
-    page = get_page();
-    first_page = page;
-    init_header(page, NULL);
-    return page;
-  }
+    return NULL;
+  init_meta(page);
+  link_page(page);
+  return page;
+}
 
-  /* Traverse the page link list to see if there is proper page for
-   * the allocation */
-  while (page)
-  {
-    page_header = (page_header_t*)page->ptr;
-
-    /* If the page is marked as large, skip it. Else if the page has
-     * enough space, return it. */
-    if (page_header->large != 1 && page_header->longest_length[0] >= size)
-      return page;
-
-    /* If we reach the end of the page link list and find nothing, 
-     * we just request new page and add it to the end of the list*/
-    if (page_header->next_page == NULL)
-    {
-      page_header->next_page = get_page();
-      init_header(page_header->next_page, page);
-      return page_header->next_page;
-    }
-
-    page = page_header->next_page;
-  }
-  return NULL;
+void
+remove_page(kma_page_t* page)
+{
+  unlink_page(page);
+  free_page(page);
+  drain_large_cache();
 }
 
-kma_page_t*
-find_free_page(void* ptr)
+void
+link_page(kma_page_t* page)
 {
-  kma_page_t* page = first_page;
-  page_header_t* page_header;
-  int offset;
+  page_meta_t* meta = META(page);
+  unsigned int order, longest = LONGEST(meta);
 
-  /* Traverse the page link list to find where the ptr locates */
-  while (page)
-  {
-    page_header = (page_header_t*)(page->ptr);
-    offset = ptr - page->ptr;
-    if (offset > 0 && offset < PAGESIZE)
-      return page;
-    page = page_header->next_page;
-  }
-  return NULL;
+  /* A full page is not listed, as it cannot serve any request */
+  if (longest == 0)
+    return;
+
+  order = ORDER(longest);
+  meta->order = order;
+  meta->prev_page = NULL;
+  meta->next_page = page_lists[order];
+  if (page_lists[order] != NULL)
+    META(page_lists[order])->prev_page = page;
+  page_lists[order] = page;
+  nonempty_orders |= 1U << order;
 }
 
 void
-remove_page(kma_page_t* page)
+unlink_page(kma_page_t* page)
 {
-  page_header_t* page_header = page->ptr;
-  kma_page_t* prev_page = page_header->prev_page;
-  kma_page_t* next_page = page_header->next_page;
+  page_meta_t* meta = META(page);
+  kma_page_t* prev_page = meta->prev_page;
+  kma_page_t* next_page = meta->next_page;
+  unsigned int order = meta->order;
+
+  if (order == NO_ORDER)
+    return;
 
-  /* Link the prev and next nodes together, and remove the page */
+  /* Link the prev and next nodes together */
   if (prev_page != NULL)
-    ((page_header_t*)(prev_page->ptr))->next_page = next_page;
+    META(prev_page)->next_page = next_page;
   else
-    first_page = next_page;
+    page_lists[order] = next_page;
 
   if (next_page != NULL)
-    ((page_header_t*)(next_page->ptr))->prev_page = prev_page;
+    META(next_page)->prev_page = prev_page;
 
-  free_page(page);
+  if (page_lists[order] == NULL)
+    nonempty_orders &= ~(1U << order);
+  meta->order = NO_ORDER;
+}
+
+void
+update_page(kma_page_t* page)
+{
+  page_meta_t* meta = META(page);
+  unsigned int longest = LONGEST(meta);
+
+  /* Nothing to do while the largest free block keeps its order */
+  if (longest != 0 && meta->order == ORDER(longest))
+    return;
+
+  unlink_page(page);
+  link_page(page);
+}
+
+#endif
+
+kma_page_t*
+get_large_page()
+{
+  if (large_cached > 0)
+    return large_cache[--large_cached];
+  return get_page();
+}
+
+void
+put_large_page(kma_page_t* page)
+{
+#if LARGE_CACHE_PAGES > 0
+  if (large_cached < LARGE_CACHE_PAGES)
+    large_cache[large_cached++] = page;
+  else
+#endif
+    free_page(page);
+}
+
+void
+drain_large_cache()
+{
+  int i;
+
+  /* Once the cached pages are all that is left in use, hand them back
+   * so that nothing is held while the allocator is idle */
+  if (large_cached > 0 && page_stats()->num_in_use == large_cached)
+  {
+    for (i = 0; i < large_cached; i++)
+      free_page(large_cache[i]);
+    large_cached = 0;
+  }
 }
 
 static unsigned int
-round_size(unsigned int size)
+block_size(unsigned int size)
 {
+  if (size <= MINBUFSIZE)
+    return MINBUFSIZE;
+  if (IS_TWO_POWER(size))
+    return size;
+
   /* | and >> operation can continuously make the lower-order bits
    * to 1. After that add another 1 to make it have higher-order 1.
    * e.g. 001010 -> 001111 ->(+1) 010000*/
@@ -364,19 +579,183 @@ round_size(unsigned int size)
   return size + 1;
 }
 
+#if BUD_LAYOUT == BUD_TREE
+void
+init_meta(kma_page_t* page)
+{
+  unsigned int i, node_size = 2 * PAGESIZE;
+  page_meta_t* meta = META(page);
+
+  /* The page is linked into its page list once the tree is built */
+  meta->prev_page = NULL;
+  meta->next_page = NULL;
+  meta->order = NO_ORDER;
+
+  /* Initialize the longest_length array, every node free */
+  for (i = 0; i < 2 * NUMBEROFBUF - 1; i++)
+  {
+    if (IS_TWO_POWER(i + 1)) node_size = node_size / 2;
+    meta->longest_length[i] = node_size;
+  }
+}
+
+unsigned int
+alloc_block(page_meta_t* meta, kma_size_t size)
+{
+  unsigned int node_size;
+  unsigned int power_size = block_size(size);
+  unsigned int offset;
+  unsigned int index = 0; 
+
+  /* Traverse the tree to find proper node index to fill */
+  for (node_size = PAGESIZE; node_size != power_size; node_size /= 2)
+  {
+    /* It has been guaranteed that there is enough space in the page when
+     * calling find_alloc_page(). So we just need to find out the child
+     * node with proper size that has enough space. */
+    if (meta->longest_length[LEFT_CHILD(index)] >= power_size)
+      index = LEFT_CHILD(index);
+    else
+      index = RIGHT_CHILD(index);
+  }
+
+  /* Calculate the offset value the index we have just found and set
+   * the available space of this node to be zero */
+  offset = OFFSET(index, node_size);
+  meta->longest_length[index] = 0;
+
+  /* Traverse back to the parent node such that the available
+   * space is updated */
+  while (index)
+  {
+    index = PARENT(index);
+    meta->longest_length[index] = LARGER(meta->longest_length[LEFT_CHILD(index)],
+                                              meta->longest_length[RIGHT_CHILD(index)]);
+  }
+
+  return offset;
+}
+
+bool
+free_block(page_meta_t* meta, unsigned int offset, kma_size_t size)
+{
+  unsigned int left_length, right_length;
+  unsigned int node_size = block_size(size);
+  unsigned int index;
+
+  /* Blocks are aligned to their size, so the offset gives the node */
+  index = (offset + PAGESIZE) / node_size - 1;
+  meta->longest_length[index] = node_size;
+
+  /* Traverse the tree bottom up to update the free node */
+  while (index)
+  {
+    index = PARENT(index);
+    node_size = node_size * 2;
+    left_length = meta->longest_length[LEFT_CHILD(index)];
+    right_length = meta->longest_length[RIGHT_CHILD(index)];
+
+    /* If both children are free, coalesce them. */
+    if (left_length + right_length == node_size)
+      meta->longest_length[index] = node_size;
+    else
+      meta->longest_length[index] = LARGER(left_length, right_length);
+  }
+
+  return meta->longest_length[0] == PAGESIZE;
+}
+#elif BUD_LAYOUT == BUD_BITMAP
+void
+init_meta(kma_page_t* page)
+{
+  unsigned int i;
+  page_meta_t* meta = META(page);
+
+  /* The page is linked into its page list once the tree is built */
+  meta->prev_page = NULL;
+  meta->next_page = NULL;
+  meta->order = NO_ORDER;
+  meta->used = 0;
+
+  /* Start with the whole page as one free block */
+  for (i = 0; i < MAPWORDS; i++)
+    meta->free_nodes[i] = 0;
+  SET_NODE(meta, 1);
+}
+
+unsigned int
+alloc_block(page_meta_t* meta, kma_size_t size)
+{
+  unsigned int power_size = block_size(size);
+  unsigned int depth = ORDER(PAGESIZE) - ORDER(power_size);
+  unsigned int level, node;
+
+  /* Take the smallest free block that is large enough. The page has
+   * one, as find_alloc_page picked it for that. */
+  for (level = depth; (node = find_node(meta, level)) == 0; level--)
+    ;
+  CLEAR_NODE(meta, node);
+
+  /* Split it down to the size, freeing the right half each time */
+  for (; level < depth; level++)
+  {
+    node = node * 2;
+    SET_NODE(meta, node + 1);
+  }
+
+  meta->used++;
+  return (node - (1U << depth)) * power_size;
+}
+
+bool
+free_block(page_meta_t* meta, unsigned int offset, kma_size_t size)
+{
+  unsigned int power_size = block_size(size);
+  unsigned int depth = ORDER(PAGESIZE) - ORDER(power_size);
+  unsigned int node = (1U << depth) + offset / power_size;
+
+  /* Coalesce with the buddy for as long as it is free */
+  for (; node > 1 && TEST_NODE(meta, node ^ 1); node = node / 2)
+    CLEAR_NODE(meta, node ^ 1);
+  SET_NODE(meta, node);
+
+  return --meta->used == 0;
+}
+
 unsigned int
-real_size(unsigned int index, unsigned int node_size)
+find_node(page_meta_t* meta, unsigned int level)
 {
-  unsigned int size = node_size;
-  unsigned int offset = OFFSET(index, node_size);
-  unsigned int occupied_offset = sizeof(page_header_t);
+  unsigned int first = 1U << level;
+  unsigned int i;
+  uint64_t word;
+
+  /* The levels above the seventh share the first word */
+  if (first < 64)
+  {
+    word = meta->free_nodes[0] & (((1ULL << first) - 1) << first);
+    return word == 0 ? 0 : __builtin_ctzll(word);
+  }
+
+  for (i = first / 64; i < 2 * first / 64; i++)
+  {
+    if (meta->free_nodes[i] != 0)
+      return i * 64 + __builtin_ctzll(meta->free_nodes[i]);
+  }
+  return 0;
+}
 
-  /* Just remove the overlapping part between the node
-   * and the header */
-  if (occupied_offset >= offset)
-    size = size - (occupied_offset - offset);
+unsigned int
+largest_block(page_meta_t* meta)
+{
+  unsigned int level;
 
-  return size;
+  for (level = 0; level <= ORDER(NUMBEROFBUF); level++)
+  {
+    if (find_node(meta, level) != 0)
+      return PAGESIZE >> level;
+  }
+  return 0;
 }
+#endif
 
 #endif // KMA_BUD
@@ -70,16 +70,15 @@ void* kma_malloc(kma_size_t size)
 {
   kma_page_t* page;
   
-  // get one page
-  page = get_page();
-  
-  // add a pointer to the page structure at the beginning of the page
-  *((kma_page_t**)page->ptr) = page;
-  
-  if ((size + sizeof(kma_page_t*)) > page->size)
-    { // requested size too large
-      free_page(page);
-      return NULL;
+  if (size > PAGESIZE)
+    { // requested size too large for one page, get a span
+      page = get_pages(NUMPAGES(size));
+      if (page == NULL)
+        return NULL;
+    }
+  else
+    { // get one page
+      page = get_page();
     }
   
   // check whether the BASEADDR macro works
@@ -89,16 +88,20 @@ void* kma_malloc(kma_size_t size)
   //}
   // oh yea, it worked
   
-  return page->ptr + sizeof(kma_page_t*);
+  return page->ptr;
 }
 
 void kma_free(void* ptr, kma_size_t size)
 {
   kma_page_t* page;
   
-  page = *((kma_page_t**)(ptr - sizeof(kma_page_t*)));
+  // the page layer knows which page holds the pointer
+  page = page_lookup(ptr);
   
-  free_page(page);
+  if (page->size > PAGESIZE)
+    free_pages(page);
+  else
+    free_page(page);
 }
 
 #endif // KMA_DUMMY
@@ -38,6 +38,8 @@
 /************System include***********************************************/
 #include <assert.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
 
 /************Private include**********************************************/
 #include "kma_page.h"
@@ -49,11 +51,107 @@
  *  variables should be in all lower case. When initializing
  *  structures and arrays, line everything up in neat columns.
  */
+/* The minimal buffer size */
+#define MINBUFSIZE 64
+/* The number of minimal buffers in each page */
+#define NUMBEROFBUF (PAGESIZE / MINBUFSIZE)
+/* The largest block served from a shared page. Larger requests get a
+ * page of their own, or a span. */
+#define MAXBUFSIZE (PAGESIZE / 2)
+
+/* The slack at or above which a free is deferred. The slack of a class
+ * is the number of its blocks in use less the number freed locally,
+ * i.e. kept on the class list without coalescing:
+ * slack >= LAZY_SLACK: lazy, the block is freed locally
+ * slack == LAZY_SLACK - 1: reclaiming, the block is freed and coalesced
+ * slack < LAZY_SLACK - 1: accelerated, a locally freed block is
+ *                         coalesced along with it */
+#ifndef LAZY_SLACK
+#define LAZY_SLACK 2
+#endif
+
+/* The number of classes, indexed by the order of their block size */
+#define NUMORDERS 32
+/* Calculate the order of a non-zero length, rounding down */
+#define ORDER(x) (31 - __builtin_clz(x))
+/* Test if the give size is power of 2 */
+#define IS_TWO_POWER(x) (!((x) & ((x) - 1)))
+
+/* The number of words in the node bitmap of a page, whose nodes are
+ * numbered from 1 at the root, so that each level starts at a power
+ * of two */
+#define MAPWORDS ((2 * NUMBEROFBUF + 63) / 64)
+/* Calculate the node of the block of a size at an offset */
+#define NODE(size, offset) (PAGESIZE / (size) + (offset) / (size))
+
+/* Test, set and clear the bit of a node in a bitmap */
+#define TEST_NODE(map, n) ((map)[(n) / 64] & (1ULL << ((n) % 64)))
+#define SET_NODE(map, n) ((map)[(n) / 64] |= (1ULL << ((n) % 64)))
+#define CLEAR_NODE(map, n) ((map)[(n) / 64] &= ~(1ULL << ((n) % 64)))
+
+/* The metadata of each page, kept out of the page:
+ * int used: the number of blocks handed out from the page
+ * uint64_t free_nodes: the bitmap of the blocks that are free and may
+ *                      be coalesced
+ * uint64_t local_nodes: the bitmap of the locally freed blocks, which
+ *                       are not coalesced */
+typedef struct {
+  int used;
+  uint64_t free_nodes[MAPWORDS];
+  uint64_t local_nodes[MAPWORDS];
+} page_meta_t;
+
+/* A free block, linked into a list of its class */
+typedef struct buddy {
+  struct buddy* next;
+  struct buddy* prev;
+} buddy_t;
+
+/* A class of blocks of one size:
+ * buddy_t* free_list: the coalesced free blocks
+ * buddy_t* local_list: the locally freed blocks
+ * int used: the number of blocks handed out
+ * int local: the number of locally freed blocks
+ * int lazy, reclaiming, accelerated: the number of frees in each state */
+typedef struct {
+  buddy_t* free_list;
+  buddy_t* local_list;
+  int used;
+  int local;
+  int lazy;
+  int reclaiming;
+  int accelerated;
+} class_t;
+
+/* The metadata of a page */
+#define META(page) ((page_meta_t*)page_entry(&page_meta, (page)->ptr))
 
 /************Global Variables*********************************************/
+/* The metadata of the pages, indexed by META */
+static kma_side_table_t page_meta = SIDE_TABLE(page_meta_t);
+
+/* The classes, and a bitmap of the classes with coalesced free blocks */
+class_t classes[NUMORDERS];
+unsigned int nonempty_orders = 0;
 
 /************Function Prototypes******************************************/
 
+/* Take a coalesced free block of the given size, splitting a larger one */
+void* take_block(unsigned int);
+/* Free a block of the given size and coalesce it with its buddies */
+void give_block(kma_page_t*, void*, unsigned int);
+/* Take a locally freed block off its class list */
+void unlink_local(kma_page_t*, buddy_t*, unsigned int);
+/* Coalesce all locally freed blocks of a page that is not used */
+void reclaim_page(kma_page_t*);
+/* Add a block to and take it off a list */
+void push_block(buddy_t**, void*);
+void unlink_block(buddy_t**, buddy_t*);
+/* Round up the given size to a block size */
+static unsigned int block_size(unsigned int);
+/* Print the number of frees in each state of every class */
+void print_stats();
+
 /************External Declaration*****************************************/
 
 /**************Implementation***********************************************/
@@ -61,13 +159,281 @@
 void*
 kma_malloc(kma_size_t size)
 {
-  return NULL;
+  kma_page_t* page;
+  class_t* class;
+  buddy_t* block;
+  unsigned int power_size;
+
+  /* A request of more than half a page would leave the rest of its
+   * page unused, so give it the page, or a span if it needs more */
+  if (size > MAXBUFSIZE)
+  {
+    page = size > PAGESIZE ? get_pages(NUMPAGES(size)) : get_page();
+    return page == NULL ? NULL : page->ptr;
+  }
+
+  power_size = block_size(size);
+  class = &classes[ORDER(power_size)];
+
+  /* Reuse a locally freed block, which needs no split */
+  block = class->local_list;
+  if (block != NULL)
+  {
+    page = page_lookup(block);
+    unlink_local(page, block, power_size);
+  }
+  else
+  {
+    block = take_block(power_size);
+    if (block == NULL)
+      return NULL;
+    page = page_lookup(block);
+  }
+
+  class->used++;
+  META(page)->used++;
+  return block;
 }
 
 void
 kma_free(void* ptr, kma_size_t size)
 {
-  ;
+  kma_page_t* page = page_lookup(ptr);
+  page_meta_t* meta;
+  class_t* class;
+  buddy_t* block;
+  unsigned int power_size;
+  int slack;
+
+  /* Whole pages and spans go straight back to the page allocator */
+  if (size > MAXBUFSIZE)
+  {
+    if (page->size > PAGESIZE)
+      free_pages(page);
+    else
+      free_page(page);
+    return;
+  }
+
+  power_size = block_size(size);
+  class = &classes[ORDER(power_size)];
+  meta = META(page);
+  slack = class->used - class->local;
+  class->used--;
+  meta->used--;
+
+  /* Lazy: keep the block on the class list for the next request */
+  if (slack >= LAZY_SLACK)
+  {
+    push_block(&class->local_list, ptr);
+    SET_NODE(meta->local_nodes, NODE(power_size, ptr - page->ptr));
+    class->local++;
+    class->lazy++;
+
+    /* A page that only holds free blocks is not kept for them */
+    if (meta->used == 0)
+      reclaim_page(page);
+    return;
+  }
+
+  /* Reclaiming: coalesce the block */
+  if (slack == LAZY_SLACK - 1)
+    class->reclaiming++;
+  else
+  {
+    /* Accelerated: coalesce a locally freed block as well */
+    class->accelerated++;
+    block = class->local_list;
+    if (block != NULL)
+    {
+      kma_page_t* local_page = page_lookup(block);
+
+      unlink_local(local_page, block, power_size);
+      give_block(local_page, block, power_size);
+    }
+  }
+
+  if (meta->used == 0)
+    reclaim_page(page);
+  give_block(page, ptr, power_size);
+}
+
+void*
+take_block(unsigned int power_size)
+{
+  kma_page_t* page;
+  page_meta_t* meta;
+  buddy_t* block;
+  unsigned int orders, node, size;
+#ifdef LZBUD_STATS
+  static int registered = 0;
+
+  if (!registered)
+  {
+    atexit(print_stats);
+    registered = 1;
+  }
+#endif
+
+  /* Take the smallest free block that is large enough, or else a new
+   * page, which is a free block of the page order */
+  orders = nonempty_orders & ~((1U << ORDER(power_size)) - 1);
+  if (orders != 0)
+  {
+    size = 1U << __builtin_ctz(orders);
+    block = classes[ORDER(size)].free_list;
+    unlink_block(&classes[ORDER(size)].free_list, block);
+    if (classes[ORDER(size)].free_list == NULL)
+      nonempty_orders &= ~(1U << ORDER(size));
+    page = page_lookup(block);
+    meta = META(page);
+    node = NODE(size, (void*)block - page->ptr);
+    CLEAR_NODE(meta->free_nodes, node);
+  }
+  else
+  {
+    page = get_page();
+    if (page == NULL)
+      return NULL;
+    meta = META(page);
+    block = page->ptr;
+    size = PAGESIZE;
+    node = 1;
+  }
+
+  /* Split it down to the size, freeing the right half each time */
+  while (size > power_size)
+  {
+    size = size / 2;
+    node = node * 2;
+    SET_NODE(meta->free_nodes, node + 1);
+    push_block(&classes[ORDER(size)].free_list, (void*)block + size);
+    nonempty_orders |= 1U << ORDER(size);
+  }
+
+  return block;
+}
+
+void
+give_block(kma_page_t* page, void* ptr, unsigned int size)
+{
+  page_meta_t* meta = META(page);
+  unsigned int offset = ptr - page->ptr;
+  unsigned int node = NODE(size, offset);
+  class_t* class;
+
+  /* Coalesce with the buddy for as long as it is free. The buddy
+   * differs from the block only in the bit of their size. */
+  for (; node > 1 && TEST_NODE(meta->free_nodes, node ^ 1); node = node / 2)
+  {
+    class = &classes[ORDER(size)];
+    CLEAR_NODE(meta->free_nodes, node ^ 1);
+    unlink_block(&class->free_list, page->ptr + (offset ^ size));
+    if (class->free_list == NULL)
+      nonempty_orders &= ~(1U << ORDER(size));
+    offset = offset & ~size;
+    size = size * 2;
+  }
+
+  /* A page that is free as a whole goes back to the page allocator */
+  if (node == 1)
+  {
+    free_page(page);
+    return;
+  }
+
+  SET_NODE(meta->free_nodes, node);
+  push_block(&classes[ORDER(size)].free_list, page->ptr + offset);
+  nonempty_orders |= 1U << ORDER(size);
+}
+
+void
+unlink_local(kma_page_t* page, buddy_t* block, unsigned int size)
+{
+  class_t* class = &classes[ORDER(size)];
+
+  unlink_block(&class->local_list, block);
+  CLEAR_NODE(META(page)->local_nodes, NODE(size, (void*)block - page->ptr));
+  class->local--;
+}
+
+void
+reclaim_page(kma_page_t* page)
+{
+  page_meta_t* meta = META(page);
+  unsigned int i, node, size;
+  void* ptr;
+
+  /* Coalesce the locally freed blocks, leaving the page free apart from
+   * the block the caller is about to give back */
+  for (i = 0; i < MAPWORDS; i++)
+  {
+    while (meta->local_nodes[i] != 0)
+    {
+      node = i * 64 + __builtin_ctzll(meta->local_nodes[i]);
+      size = PAGESIZE >> ORDER(node);
+      ptr = page->ptr + (node - (1U << ORDER(node))) * size;
+      unlink_local(page, ptr, size);
+      give_block(page, ptr, size);
+    }
+  }
+}
+
+void
+push_block(buddy_t** list, void* ptr)
+{
+  buddy_t* block = ptr;
+
+  block->prev = NULL;
+  block->next = *list;
+  if (*list != NULL)
+    (*list)->prev = block;
+  *list = block;
+}
+
+void
+unlink_block(buddy_t** list, buddy_t* block)
+{
+  /* Link the prev and next blocks together */
+  if (block->prev != NULL)
+    block->prev->next = block->next;
+  else
+    *list = block->next;
+
+  if (block->next != NULL)
+    block->next->prev = block->prev;
+}
+
+static unsigned int
+block_size(unsigned int size)
+{
+  if (size <= MINBUFSIZE)
+    return MINBUFSIZE;
+  if (IS_TWO_POWER(size))
+    return size;
+
+  /* | and >> operation can continuously make the lower-order bits
+   * to 1. After that add another 1 to make it have higher-order 1.
+   * e.g. 001010 -> 001111 ->(+1) 010000*/
+  size = size | (size >> 1);
+  size = size | (size >> 2);
+  size = size | (size >> 4);
+  size = size | (size >> 8);
+  size = size | (size >> 16);
+  return size + 1;
+}
+
+void
+print_stats()
+{
+  unsigned int order;
+
+  printf("%10s %10s %10s %12s\n", "class", "lazy", "reclaiming", "accelerated");
+  for (order = ORDER(MINBUFSIZE); order <= ORDER(MAXBUFSIZE); order++)
+  {
+    printf("%10u %10d %10d %12d\n", 1U << order, classes[order].lazy,
+           classes[order].reclaiming, classes[order].accelerated);
+  }
 }
 
 #endif // KMA_LZBUD
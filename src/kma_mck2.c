@@ -38,6 +38,7 @@
 /************System include***********************************************/
 #include <assert.h>
 #include <stdlib.h>
+#include <stdint.h>
 
 /************Private include**********************************************/
 #include "kma_page.h"
@@ -49,10 +50,55 @@
  *  variables should be in all lower case. When initializing
  *  structures and arrays, line everything up in neat columns.
  */
+/* The smallest bucket, which has to hold the links of a free buffer */
+#define MINBUCKET 16
+/* The largest bucket. Larger requests get pages of their own. */
+#define MAXBUCKET (PAGESIZE / 2)
+
+/* The number of buckets, indexed by the order of their buffer size */
+#define NUMORDERS 32
+/* Calculate the order of a non-zero length, rounding down */
+#define ORDER(x) (31 - __builtin_clz(x))
+/* Test if the give size is power of 2 */
+#define IS_TWO_POWER(x) (!((x) & ((x) - 1)))
+/* Mark a page that is handed out whole, or as a span */
+#define LARGE_BUCKET 0
+
+/* A free buffer, linked into the list of its bucket */
+typedef struct buffer {
+  struct buffer* next;
+  struct buffer* prev;
+} buffer_t;
+
+/* The entry of each page in kmemsizes, instead of a header in every
+ * buffer:
+ * uint8_t order: the bucket the page is divided into, or LARGE_BUCKET
+ * uint16_t free: the number of free buffers in the page */
+typedef struct {
+  uint8_t order;
+  uint16_t free;
+} kmemsize_t;
+
+/* The entry of the page holding an address */
+#define KMEMSIZE(ptr) ((kmemsize_t*)page_entry(&kmemsizes, (ptr)))
 
 /************Global Variables*********************************************/
+/* The bucket of every page, indexed by KMEMSIZE */
+static kma_side_table_t kmemsizes = SIDE_TABLE(kmemsize_t);
+
+/* The free buffers of each bucket */
+buffer_t* buckets[NUMORDERS];
 
 /************Function Prototypes******************************************/
+/* Divide a new page into buffers of a bucket */
+bool fill_bucket(unsigned int);
+/* Take the free buffers of a page off its bucket and free it */
+void release_page(kma_page_t*, unsigned int);
+/* Add a buffer to and take it off the list of its bucket */
+void push_buffer(unsigned int, void*);
+void unlink_buffer(unsigned int, buffer_t*);
+/* Round up the given size to a bucket size */
+static unsigned int bucket_size(unsigned int);
 
 /************External Declaration*****************************************/
 
@@ -61,13 +107,129 @@
 void*
 kma_malloc(kma_size_t size)
 {
-  return NULL;
+  kma_page_t* page;
+  buffer_t* buffer;
+  unsigned int order;
+
+  /* A request larger than the largest bucket gets its own pages */
+  if (size > MAXBUCKET)
+  {
+    page = size > PAGESIZE ? get_pages(NUMPAGES(size)) : get_page();
+    if (page == NULL)
+      return NULL;
+    KMEMSIZE(page->ptr)->order = LARGE_BUCKET;
+    return page->ptr;
+  }
+
+  order = ORDER(bucket_size(size));
+  if (buckets[order] == NULL && !fill_bucket(order))
+    return NULL;
+
+  buffer = buckets[order];
+  unlink_buffer(order, buffer);
+  KMEMSIZE(buffer)->free--;
+  return buffer;
 }
 
 void
 kma_free(void* ptr, kma_size_t size)
 {
-  ;
+  kmemsize_t* kmemsize = KMEMSIZE(ptr);
+  unsigned int order = kmemsize->order;
+  kma_page_t* page;
+
+  /* The bucket comes from the page, not from the size */
+  if (order == LARGE_BUCKET)
+  {
+    page = page_lookup(ptr);
+    if (page->size > PAGESIZE)
+      free_pages(page);
+    else
+      free_page(page);
+    return;
+  }
+
+  push_buffer(order, ptr);
+
+  /* Give the page back once all of its buffers are free */
+  if (++kmemsize->free == PAGESIZE >> order)
+    release_page(page_lookup(ptr), order);
+}
+
+bool
+fill_bucket(unsigned int order)
+{
+  kma_page_t* page = get_page();
+  unsigned int size = 1U << order;
+  int offset;
+
+  if (page == NULL)
+    return FALSE;
+
+  KMEMSIZE(page->ptr)->order = order;
+  KMEMSIZE(page->ptr)->free = PAGESIZE >> order;
+
+  /* Push from the end, so that the buffers go out in address order */
+  for (offset = PAGESIZE - size; offset >= 0; offset -= size)
+    push_buffer(order, page->ptr + offset);
+
+  return TRUE;
+}
+
+void
+release_page(kma_page_t* page, unsigned int order)
+{
+  unsigned int size = 1U << order;
+  unsigned int offset;
+
+  for (offset = 0; offset < PAGESIZE; offset += size)
+    unlink_buffer(order, page->ptr + offset);
+
+  free_page(page);
+}
+
+void
+push_buffer(unsigned int order, void* ptr)
+{
+  buffer_t* buffer = ptr;
+
+  buffer->prev = NULL;
+  buffer->next = buckets[order];
+  if (buckets[order] != NULL)
+    buckets[order]->prev = buffer;
+  buckets[order] = buffer;
+}
+
+void
+unlink_buffer(unsigned int order, buffer_t* buffer)
+{
+  /* Link the prev and next buffers together */
+  if (buffer->prev != NULL)
+    buffer->prev->next = buffer->next;
+  else
+    buckets[order] = buffer->next;
+
+  if (buffer->next != NULL)
+    buffer->next->prev = buffer->prev;
+}
+
+static unsigned int
+bucket_size(unsigned int size)
+{
+  if (size <= MINBUCKET)
+    return MINBUCKET;
+  if (IS_TWO_POWER(size))
+    return size;
+
+  /* | and >> operation can continuously make the lower-order bits
+   * to 1. After that add another 1 to make it have higher-order 1.
+   * e.g. 001010 -> 001111 ->(+1) 010000*/
+  size = size | (size >> 1);
+  size = size | (size >> 2);
+  size = size | (size >> 4);
+  size = size | (size >> 8);
+  size = size | (size >> 16);
+  return size + 1;
 }
 
 #endif // KMA_MCK2
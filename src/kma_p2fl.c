@@ -50,29 +50,104 @@
  *  variables should be in all lower case. When initializing
  *  structures and arrays, line everything up in neat columns.
  */
-#define MINBUFSIZE 32;
-
-/* The header in each buffer. Only the first buffer in each page
- * have non-zero used_space value*/
+#ifndef MINBUFSIZE
+#define MINBUFSIZE 32
+#endif
+
+/* The number of empty pages each free list keeps for reuse, before an
+ * empty page goes back to the page allocator. Kept pages count as
+ * waste, so none are kept by default. */
+#ifndef EMPTY_PAGES
+#define EMPTY_PAGES 0
+#endif
+
+/* Calculate the order of a non-zero length, rounding down */
+#define ORDER(x) (31 - __builtin_clz(x))
+
+/* The last byte of a request, counting from 0. Requests of up to
+ * MINBUFSIZE bytes, including 0, are rounded up to the first list. */
+#define LAST_BYTE(size) ((size) > MINBUFSIZE ? (size) - 1 : MINBUFSIZE - 1)
+
+#ifdef GEOMETRIC_CLASSES
+/* Four sizes for every doubling, from MINBUFSIZE up to PAGESIZE, so
+ * that a buffer wastes at most a fifth of its size instead of half */
+#if PAGESIZE > (MINBUFSIZE << 11)
+#error "PAGESIZE is beyond the class table"
+#endif
+
+/* The sizes above b up to 2b */
+#define STEPS(b) (b) * 5 / 4, (b) * 3 / 2, (b) * 7 / 4, (b) * 2
+
+/* Calculate the index of the free list for a request. The order of
+ * the request picks the doubling, and the two bits below its leading
+ * bit the step within it. */
+#define CLASS(size) GEOMETRIC_CLASS(LAST_BYTE(size))
+#define GEOMETRIC_CLASS(n) ((ORDER(n) - ORDER(MINBUFSIZE)) * 4 + 1 \
+                            + (((n) >> (ORDER(n) - 2)) & 3))
+/* The buffer size of a free list */
+#define CLASS_SIZE(index) class_sizes[index]
+#else
+/* Calculate the index of the free list for a request, the order of
+ * the buffer it needs above the order of the minimal buffer */
+#define CLASS(size) (ORDER(LAST_BYTE(size)) + 1 - ORDER(MINBUFSIZE))
+/* The buffer size of a free list */
+#define CLASS_SIZE(index) (MINBUFSIZE << (index))
+#endif
+
+/* The number of free lists, the last one for whole pages */
+#define NUMCLASSES (CLASS(PAGESIZE) + 1)
+
+/* The states of a page, each with a list in its free list */
+#define PARTIAL 0
+#define FULL 1
+#define EMPTY 2
+#define NUMSTATES 3
+
+/* A free buffer, linked to the next free buffer of its page. Buffers
+ * in use carry no header, kma_free finds their page and size through
+ * the page descriptor. */
 typedef struct buffer_t
 {
-  kma_page_t* page; 
-  unsigned int used_space;
   struct buffer_t* next_buffer;
-} buffer_header_t;
+} buffer_t;
 
-/* The head of free lists */
+/* The head of free lists, with the descriptors of the pages divided
+ * into buffers of its size listed by their state */
 typedef struct free_t
 {
   kma_size_t size;
-  struct free_t* next_list;
-  buffer_header_t* first_buffer;
+  unsigned int num_empty;
+  struct slab_t* slabs[NUMSTATES];
 } free_list_t;
 
-/* A global header that manages the number of pages and free lists */
+/* The descriptor of each page, kept out of the page. The page tag
+ * points to it:
+ * kma_page_t* page: the page it describes
+ * free_list_t* free_list: the free list the page was built for
+ * buffer_t* first_buffer: the freed buffers of the page
+ * unsigned int carved: the offset of the first buffer never handed out
+ * unsigned int used_space: the space of the buffers in use
+ * int state: the list of the free list the page is on
+ * slab_t* prev_slab, next_slab: the neighbours on that list */
+typedef struct slab_t
+{
+  kma_page_t* page;
+  free_list_t* free_list;
+  buffer_t* first_buffer;
+  unsigned int carved;
+  unsigned int used_space;
+  int state;
+  struct slab_t* prev_slab;
+  struct slab_t* next_slab;
+} slab_t;
+
+/* A global header that manages the number of pages and free lists.
+ * The free lists follow it in the page, one for every size class from
+ * MINBUFSIZE to PAGESIZE, and are indexed by CLASS */
 typedef struct
 {
   unsigned int page_counter;
+  unsigned int buffer_counter;
   kma_page_t* page;
   free_list_t* free_lists;
 } global_header_t;
@@ -80,19 +155,37 @@ typedef struct
 /************Global Variables*********************************************/
 global_header_t* global_header = NULL;
 
+/* The descriptors of the pages */
+static kma_side_table_t slab_table = SIDE_TABLE(slab_t);
+
+#ifdef GEOMETRIC_CLASSES
+/* The buffer sizes of the free lists, of which the first NUMCLASSES
+ * are used */
+static const kma_size_t class_sizes[] = {
+  MINBUFSIZE,
+  STEPS(MINBUFSIZE),       STEPS(MINBUFSIZE << 1),  STEPS(MINBUFSIZE << 2),
+  STEPS(MINBUFSIZE << 3),  STEPS(MINBUFSIZE << 4),  STEPS(MINBUFSIZE << 5),
+  STEPS(MINBUFSIZE << 6),  STEPS(MINBUFSIZE << 7),  STEPS(MINBUFSIZE << 8),
+  STEPS(MINBUFSIZE << 9),  STEPS(MINBUFSIZE << 10)
+};
+#endif
+
 /************Function Prototypes******************************************/
 /* Initialize the global header and free lists if not exist*/
 void init_free_lists();
-/* Build buffers for the free list of given size */
-buffer_header_t* build_free_list(kma_size_t);
+/* Get a new page for the given free list */
+slab_t* build_page(free_list_t*);
 
-/* Select proper free list size for the given size */
-kma_size_t select_buffer_size(kma_size_t);
-/* Find the suitable buffer in the free list of given size */
-void* find_buffer(kma_size_t);
+/* Take a buffer from the given free list */
+void* find_buffer(free_list_t*);
 
-/* Remove the free buffers of an empty page in the free list */
-void remove_page(free_list_t*, kma_page_t*);
+/* Add a page to and take it off the list of its state */
+void link_page(slab_t*, int);
+void unlink_page(slab_t*);
+/* Take an empty page off its free list and free it */
+void remove_page(slab_t*);
+/* Free the empty pages of all free lists */
+void remove_empty_pages();
 
 /************External Declaration*****************************************/
 
@@ -101,158 +194,182 @@ void remove_page(free_list_t*, kma_page_t*);
 void
 init_free_lists()
 {
-  unsigned int size = MINBUFSIZE;
-  unsigned int offset = sizeof(global_header_t);
-
   free_list_t* current_list;
+  int index, state;
 
   /* Request a page for managing the freelists globally */
   kma_page_t* page = get_page();
 
-  /* Fill in the first free list */
   global_header = (global_header_t*)(page->ptr);
   global_header->page_counter = 1;
+  global_header->buffer_counter = 0;
   global_header->page = page;
-
-  global_header->free_lists = (free_list_t*)(page->ptr + offset);
-  offset = offset + sizeof(free_list_t);
+  global_header->free_lists = (free_list_t*)(page->ptr + sizeof(global_header_t));
 
   /* Fill in the header for the free lists in each size */
   current_list = global_header->free_lists;
-  while (size <= PAGESIZE)
+  for (index = 0; index < NUMCLASSES; index++, current_list++)
   {
-    current_list->first_buffer = NULL;
-    current_list->next_list = (free_list_t*)(page->ptr + offset);
-    current_list->size = size;
-
-    current_list = current_list->next_list;
-    offset = offset + sizeof(free_list_t);
-    size = size * 2;
+    for (state = 0; state < NUMSTATES; state++)
+      current_list->slabs[state] = NULL;
+    current_list->num_empty = 0;
+    current_list->size = CLASS_SIZE(index);
   }
-  current_list->next_list = NULL;
 }
 
 void*
 kma_malloc(kma_size_t size)
 {
-  kma_size_t buffer_size;
+  kma_page_t* page;
+
+  /* If the request does not fit in the largest buffer, serve it from
+   * a span of pages */
+  if (size > PAGESIZE)
+  {
+    page = get_pages(NUMPAGES(size));
+    return page == NULL ? NULL : page->ptr;
+  }
 
   /* If there is no free lists available, initialize them */
   if (global_header == NULL)
     init_free_lists();
   
-  /* Select the proper size for the request size */
-  buffer_size = select_buffer_size(size);
-  
   /* Pick up the proper size buffer from the free list */
-  if (buffer_size != -1)
-    return find_buffer(buffer_size);
-  
-  return NULL;
-}
-
-kma_size_t
-select_buffer_size(kma_size_t size)
-{
-  /* Starting from the minimal buffer size, we look for
-   * the proper 2^n size to fit the incoming size */
-  kma_size_t buffer_size = MINBUFSIZE;
-  while (buffer_size <= PAGESIZE)
-  {
-    if (buffer_size >= (size + sizeof(buffer_header_t)))
-      return buffer_size;
-    buffer_size = buffer_size * 2;
-  }
-  return -1;
+  return find_buffer(&global_header->free_lists[CLASS(size)]);
 }
 
 void*
-find_buffer(kma_size_t buffer_size)
+find_buffer(free_list_t* current_list)
 {
-  free_list_t* current_list = global_header->free_lists;
-  buffer_header_t* current_buffer;
+  buffer_t* current_buffer;
+  slab_t* slab;
 
-  /* Traverse the free lists to find the one with proper size */
-  while (current_list->size != buffer_size)
-    current_list = current_list->next_list;
-
-  /* In the proper free list, check if there is free buffer */
-  current_buffer = current_list->first_buffer;
-  if (current_buffer == NULL)
+  /* Take a page with free buffers, then an empty page, and build a
+   * new one if there is neither */
+  slab = current_list->slabs[PARTIAL];
+  if (slab == NULL)
   {
-    /* Build up the free lists if there is no free buffer */
-    current_buffer = build_free_list(buffer_size);
-
-    if (current_buffer == NULL)
-      return NULL;
+    slab = current_list->slabs[EMPTY];
+    if (slab != NULL)
+    {
+      unlink_page(slab);
+      current_list->num_empty--;
+    }
+    else
+    {
+      slab = build_page(current_list);
+      if (slab == NULL)
+        return NULL;
+    }
+    link_page(slab, PARTIAL);
   }
 
-  /* Connect the free list head with the next buffer, and
-   * remove the current buffer from the free list */
-  current_list->first_buffer = current_buffer->next_buffer;
-
-  /* Reconnect the next_buffer to the free list such that
-   * it can be freed later easily */
-  current_buffer->next_buffer = (buffer_header_t*)current_list;
+  /* Remove the first freed buffer of the page, or carve the next one
+   * off its untouched tail, and move the page to the full pages once
+   * it has neither left */
+  current_buffer = slab->first_buffer;
+  if (current_buffer != NULL)
+    slab->first_buffer = current_buffer->next_buffer;
+  else
+  {
+    current_buffer = slab->page->ptr + slab->carved;
+    slab->carved += current_list->size;
+  }
+  slab->used_space += current_list->size;
+  if (slab->first_buffer == NULL
+      && slab->carved + current_list->size > PAGESIZE)
+  {
+    unlink_page(slab);
+    link_page(slab, FULL);
+  }
 
-  /* Increment the used space of this page */
-  ((buffer_header_t*)(current_buffer->page->ptr))->used_space += buffer_size; 
-  
-  return ((void*)current_buffer + sizeof(buffer_header_t));
+  global_header->buffer_counter++;
+  return current_buffer;
 }
 
-buffer_header_t*
-build_free_list(kma_size_t size)
+slab_t*
+build_page(free_list_t* free_list)
 {
-  unsigned int offset = size;
+  slab_t* slab;
 
   kma_page_t* page = get_page();
   if (page == NULL) return NULL;
 
+  /* Fill in the descriptor of the page and tag the page with it,
+   * which is how kma_free finds the page's free buffers and the size
+   * of a buffer */
+  slab = page_entry(&slab_table, page->ptr);
+  page->tag = slab;
+  slab->page = page;
+  slab->free_list = free_list;
+  slab->used_space = 0;
+
+  /* The buffers are carved off the page as they are needed, so the
+   * page is not touched here, and a tail that is never needed is
+   * never faulted in. A size that does not divide the page leaves the
+   * rest of it unused. */
+  slab->first_buffer = NULL;
+  slab->carved = 0;
+
   /* Increment the counter for the number of pages */
   (global_header->page_counter)++;
 
-  /* Divide the page into buffers with given size */
-  buffer_header_t* current_buffer = page->ptr;
-  while (offset < PAGESIZE)
-  {
-    current_buffer->next_buffer = (buffer_header_t*)(page->ptr + offset);
-    current_buffer->used_space = 0;
-    current_buffer->page = page;
-
-    current_buffer = current_buffer->next_buffer;
-    offset = offset + size;
-  }
-  /* Deal with last buffer of the page */
-  current_buffer->next_buffer = NULL;
-  current_buffer->used_space = 0;
-  current_buffer->page = page;
-
-  return (buffer_header_t*)(page->ptr);
+  return slab;
 }
 
 void
 kma_free(void* ptr, kma_size_t size)
 {
-  /* Get the header of the buffer */
-  buffer_header_t* buffer = ptr - sizeof(buffer_header_t);
+  buffer_t* buffer;
+  free_list_t* free_list;
+  slab_t* slab;
 
-  /* Get the header of the corresponding free list */
-  free_list_t* free_list = (free_list_t*)(buffer->next_buffer);
+  /* Spans go straight back to the page allocator */
+  if (size > PAGESIZE)
+  {
+    free_pages(page_lookup(ptr));
+    return;
+  }
 
-  /* Add the buffer to the beginning of the free list */
-  buffer->next_buffer = free_list->first_buffer;
-  free_list->first_buffer = buffer;
+  /* Get the page of the buffer and the free list it belongs to */
+  buffer = ptr;
+  slab = page_lookup(buffer)->tag;
+  free_list = slab->free_list;
 
-  /* Decrement the used space of this page */
-  ((buffer_header_t*)(buffer->page->ptr))->used_space -= free_list->size; 
+  /* Add the buffer to the beginning of the free buffers of its page,
+   * which has room again if it was full */
+  buffer->next_buffer = slab->first_buffer;
+  slab->first_buffer = buffer;
+  if (slab->state == FULL)
+  {
+    unlink_page(slab);
+    link_page(slab, PARTIAL);
+  }
 
-  /* If the used space in the page is zero, we need 
-   * to free the page after free the buffer */
-  if (((buffer_header_t*)(buffer->page->ptr))->used_space == 0)
-    remove_page(free_list, buffer->page);
+  /* Decrement the used space of this page. An empty page is kept for
+   * the next request if its free list has room for one, and freed
+   * otherwise. */
+  slab->used_space -= free_list->size;
+  if (slab->used_space == 0)
+  {
+    unlink_page(slab);
+    if (free_list->num_empty < EMPTY_PAGES)
+    {
+      /* Carve the page again from the front, so that its freed
+       * buffers need not be walked */
+      slab->first_buffer = NULL;
+      slab->carved = 0;
+      link_page(slab, EMPTY);
+      free_list->num_empty++;
+    }
+    else
+      remove_page(slab);
+  }
 
-  /* Free the global header page if this is the only page left */
+  /* Once no buffer is in use, free the empty pages and the global
+   * header page, which is the only page left then */
+  if (--global_header->buffer_counter == 0)
+    remove_empty_pages();
   if (global_header->page_counter == 1)
   {
     free_page(global_header->page);
@@ -261,43 +378,56 @@ kma_free(void* ptr, kma_size_t size)
 }
 
 void
-remove_page(free_list_t* free_list, kma_page_t* page)
+link_page(slab_t* slab, int state)
 {
-  unsigned int page_id = page->id;
-  buffer_header_t* prev_buffer = NULL;
-  buffer_header_t* current_buffer = free_list->first_buffer; 
+  slab_t** head = &slab->free_list->slabs[state];
+
+  slab->state = state;
+  slab->prev_slab = NULL;
+  slab->next_slab = *head;
+  if (*head != NULL)
+    (*head)->prev_slab = slab;
+  *head = slab;
+}
 
-  /* First we need to remove those free buffers in the free list */
-  while (current_buffer)
-  {
-    if (current_buffer->page->id == page_id)
-    {
-      /* In many cases there are several buffers in the same page connecting
-       * continuously in the free list, thus we can remove them together */
-      while ((current_buffer->page->id == page_id))
-      {
-        current_buffer = current_buffer->next_buffer;
-        if (current_buffer == NULL) break;
-      }
-
-      /* After removing the buffers from the free list, reconnect the rest
-       * free buffers */
-      if (prev_buffer)
-        prev_buffer->next_buffer = current_buffer;
-      else
-        free_list->first_buffer = current_buffer;
-
-      if (current_buffer == NULL)
-        break;
-    }
-    prev_buffer = current_buffer;
-    current_buffer = current_buffer->next_buffer;
-  }
+void
+unlink_page(slab_t* slab)
+{
+  /* Link the prev and next pages together */
+  if (slab->prev_slab != NULL)
+    slab->prev_slab->next_slab = slab->next_slab;
+  else
+    slab->free_list->slabs[slab->state] = slab->next_slab;
+
+  if (slab->next_slab != NULL)
+    slab->next_slab->prev_slab = slab->prev_slab;
+}
 
+void
+remove_page(slab_t* slab)
+{
   /* Decrement the counter for the number of pages */
   (global_header->page_counter)--;
 
-  free_page(page);
+  free_page(slab->page);
+}
+
+void
+remove_empty_pages()
+{
+  free_list_t* current_list = global_header->free_lists;
+  slab_t* slab;
+  int index;
+
+  for (index = 0; index < NUMCLASSES; index++, current_list++)
+  {
+    while ((slab = current_list->slabs[EMPTY]) != NULL)
+    {
+      unlink_page(slab);
+      remove_page(slab);
+    }
+    current_list->num_empty = 0;
+  }
 }
 
 #endif // KMA_P2FL
@@ -45,6 +45,14 @@
 #include <string.h>
 #include <strings.h>
 #include <stdio.h>
+#include <sys/mman.h>
+#include <time.h>
+#ifdef KMA_THREADS
+#include <pthread.h>
+#endif
+#if defined(PAGE_DETAILS) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#endif
 
 /************Private include**********************************************/
 #include "kma_page.h"
@@ -57,16 +65,342 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
+/* The pool reserves address space for MAXPAGES pages up front, but only
+ * maps it in chunks of CHUNKPAGES pages as they are needed. Chunks are
+ * 2 MB by default, whatever the page size. */
+#ifndef CHUNKPAGES
+#if PAGESIZE < 2097152
+#define CHUNKPAGES (2097152 / PAGESIZE)
+#else
+#define CHUNKPAGES 1
+#endif
+#endif
+
+#define CHUNKSIZE (CHUNKPAGES * PAGESIZE)
+#define NUMCHUNKS (MAXPAGES / CHUNKPAGES)
+
+/* A chunk without pages in use is unmapped once this many page requests
+ * and releases went by without touching it */
+#ifndef CHUNK_IDLE_TICKS
+#define CHUNK_IDLE_TICKS 4096
+#endif
+
+/* What to do with the pool once no pages are in use:
+ * POOL_RELEASE: unmap the whole pool, to be set up again on the next
+ *               request
+ * POOL_KEEP: keep the pool, idle chunks are still unmapped by the sweep
+ * POOL_WARM: keep the POOL_WARM_PAGES most recently freed pages and
+ *            unmap every chunk that holds none of them
+ * POOL_TIMED: keep the pool, but age idle chunks by wall clock time and
+ *             unmap them after POOL_IDLE_MS, and the pool with them
+ *             once it is empty */
+#define POOL_RELEASE 0
+#define POOL_KEEP 1
+#define POOL_WARM 2
+#define POOL_TIMED 3
+
+#ifndef POOL_RETENTION
+#define POOL_RETENTION POOL_KEEP
+#endif
+
+#ifndef POOL_WARM_PAGES
+#define POOL_WARM_PAGES 64
+#endif
+
+#ifndef POOL_IDLE_MS
+#define POOL_IDLE_MS 100
+#endif
+
+/* How the chunks of the pool are backed:
+ * HUGEPAGE_NONE: regular pages
+ * HUGEPAGE_MADVISE: regular pages, with transparent huge pages
+ *                   requested through madvise(MADV_HUGEPAGE)
+ * HUGEPAGE_HUGETLB: pages from the hugetlbfs pool through MAP_HUGETLB,
+ *                   falling back to HUGEPAGE_MADVISE for a chunk when
+ *                   no huge pages are available
+ * Either huge page mode needs CHUNKSIZE to be a multiple of the huge
+ * page size, which the defaults are for 2 MB huge pages. */
+#define HUGEPAGE_NONE 0
+#define HUGEPAGE_MADVISE 1
+#define HUGEPAGE_HUGETLB 2
+
+#ifndef POOL_HUGEPAGE
+#define POOL_HUGEPAGE HUGEPAGE_NONE
+#endif
+
+/* Free pages beyond the first DECOMMIT_WATERMARK on the free stack are
+ * handed back to the kernel with DECOMMIT_ADVICE, DECOMMIT_BATCH pages
+ * at a time. A freed span is handed back right away while more than
+ * DECOMMIT_WATERMARK free pages are resident. */
+#ifndef DECOMMIT_WATERMARK
+#define DECOMMIT_WATERMARK 64
+#endif
+
+#ifndef DECOMMIT_BATCH
+#define DECOMMIT_BATCH 32
+#endif
+
+#ifndef DECOMMIT_ADVICE
+#define DECOMMIT_ADVICE MADV_DONTNEED
+#endif
+
+/* How freed single pages are reused:
+ * REUSE_LIFO: the most recently freed page is handed out first, from
+ *             the free stack
+ * REUSE_ADDRESS: freed pages go to the free map and the lowest free
+ *                page is handed out first, so the pages in use stay
+ *                packed at the bottom of the pool and the free pages
+ *                at the top are the ones decommitted */
+#define REUSE_LIFO 0
+#define REUSE_ADDRESS 1
+
+#ifndef PAGE_REUSE
+#define PAGE_REUSE REUSE_LIFO
+#endif
+
+#if PAGE_REUSE == REUSE_ADDRESS && POOL_RETENTION == POOL_WARM
+#error "POOL_WARM needs PAGE_REUSE == REUSE_LIFO"
+#endif
+
+/* Built with KMA_THREADS, the pool may be used from several threads.
+ * Single pages then go through a cache of up to CACHE_PAGES pages per
+ * thread, which trades CACHE_BATCH pages at a time with the lock-free
+ * free stack. Everything else runs under the pool lock. Chunks are never
+ * unmapped in this mode, since a thread that lost the race for a page
+ * may still read its link, so idle memory only goes back to the kernel
+ * through the decommit watermark. */
+#ifdef KMA_THREADS
+#ifndef CACHE_PAGES
+#define CACHE_PAGES 32
+#endif
+
+#ifndef CACHE_BATCH
+#define CACHE_BATCH (CACHE_PAGES / 2)
+#endif
+
+#if POOL_RETENTION != POOL_KEEP
+#error "KMA_THREADS only supports POOL_RETENTION == POOL_KEEP"
+#endif
+#endif
+
+/* Number of bits in a word of the free map */
+#define MAPBITS (8 * sizeof(unsigned long))
+
+/* Calculate the page number of a page address within the pool */
+#define PAGE_INDEX(x) ((int)(((x) - pool) / PAGESIZE))
+/* Calculate the chunk number of a page number */
+#define CHUNK_INDEX(n) ((n) / CHUNKPAGES)
+
+/* Calculate the smaller number of x and y */
+#define LOWER(x, y) ((x) < (y) ? (x) : (y))
+
+/* Test, set and clear the bit of a page in a page bitmap. Threads own
+ * different pages but share the words of the bitmaps. */
+#define TEST_BIT(map, n) ((map)[(n) / MAPBITS] & (1UL << ((n) % MAPBITS)))
+#ifdef KMA_THREADS
+#define SET_BIT(map, n) \
+  __sync_fetch_and_or(&(map)[(n) / MAPBITS], 1UL << ((n) % MAPBITS))
+#define CLEAR_BIT(map, n) \
+  __sync_fetch_and_and(&(map)[(n) / MAPBITS], ~(1UL << ((n) % MAPBITS)))
+#else
+#define SET_BIT(map, n) ((map)[(n) / MAPBITS] |= (1UL << ((n) % MAPBITS)))
+#define CLEAR_BIT(map, n) ((map)[(n) / MAPBITS] &= ~(1UL << ((n) % MAPBITS)))
+#endif
+
+/* Test, set and clear the bit of a page in the free map */
+#define TEST_FREE(n) TEST_BIT(free_map, n)
+#define SET_FREE(n) (SET_BIT(free_map, n), \
+                     map_low = LOWER(map_low, (n) / MAPBITS))
+#define CLEAR_FREE(n) CLEAR_BIT(free_map, n)
+
+/* Add n to a counter shared between threads and yield the new value,
+ * and read such a counter while other threads may update it */
+#ifdef KMA_THREADS
+#define ATOMIC_ADD(x, n) __sync_add_and_fetch(&(x), (n))
+#define ATOMIC_LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#else
+#define ATOMIC_ADD(x, n) ((x) += (n))
+#define ATOMIC_LOAD(x) (x)
+#endif
+
+/* The page clock, advanced by every page request and release */
+#define PAGE_CLOCK() (ATOMIC_LOAD(kma_page_stats.num_requested) \
+                      + ATOMIC_LOAD(kma_page_stats.num_freed))
+#define STAT_ADD(x, n) ATOMIC_ADD(kma_page_stats.x, (n))
+
+/* Serialize the slow paths that touch the free map and the chunks */
+#ifdef KMA_THREADS
+#define POOL_LOCK() pthread_mutex_lock(&pool_lock)
+#define POOL_UNLOCK() pthread_mutex_unlock(&pool_lock)
+#else
+#define POOL_LOCK()
+#define POOL_UNLOCK()
+#endif
+
+/* Read the cycle counter, or the clock in ns where there is none */
+#if defined(__x86_64__) || defined(__i386__)
+#define CYCLES() __rdtsc()
+#else
+#define CYCLES() clockNs()
+#endif
+
+/* The head of the shared free stack packs the number of the top page,
+ * plus one so that zero means empty, with a tag bumped by every update.
+ * A thread holding a stale head thus fails its compare-and-swap even if
+ * the same page made it back to the top in the meantime. */
+#define HEAD_PAGE(h) ((int)((h) & 0xffffffffULL))
+#define HEAD_TAG(h) ((h) >> 32)
+#define MAKE_HEAD(tag, page) (((tag) << 32) | (unsigned long long)(page))
+#define HEAD_PTR(h) \
+  (HEAD_PAGE(h) == 0 ? NULL : pool + (HEAD_PAGE(h) - 1) * PAGESIZE)
+
+/* The state of a chunk of the pool:
+ * int committed: whether the chunk is mapped
+ * int in_use: the number of pages of the chunk in use
+ * int idle_since: the page clock when in_use last dropped to zero
+ * long idle_time: the wall clock in ms at the same point, only kept
+ *                 for the POOL_TIMED policy
+ * int hugetlb: whether the chunk is mapped from hugetlbfs */
+typedef struct
+{
+  int committed;
+  int in_use;
+  int idle_since;
+  long idle_time;
+  int hugetlb;
+} chunk_t;
+
+#ifdef KMA_THREADS
+/* The pages a thread keeps to itself, the top of the cache at the end */
+typedef struct
+{
+  void* pages[CACHE_PAGES];
+  int count;
+  bool registered;
+} page_cache_t;
+#endif
+
 /************Global Variables*********************************************/
-static kma_page_stat_t kma_page_stats = { 0, 0, 0, PAGESIZE };
+static kma_page_stat_t kma_page_stats = { 0, 0, 0, PAGESIZE, 0, 0, 0 };
+static kma_page_detail_t kma_page_details;
 
 static void* pool = NULL;
+#ifdef KMA_THREADS
+static volatile unsigned long long free_head = 0;
+#else
 static void* next_free_page = NULL;
+#endif
+static int num_free_pages = 0;
+static int next_page_id = 0;
+static bool pool_built = FALSE;
+static int next_sweep = CHUNK_IDLE_TICKS;
+
+/* The never-used pages [bump, bump_end) of the last chunk mapped from
+ * the bottom. They are handed out in address order without being
+ * touched, so a page is only faulted in when it is first used. */
+static int bump = 0;
+static int bump_end = 0;
+
+/* The lowest unmapped chunk, or NUMCHUNKS when all chunks are mapped */
+static int low_chunk = 0;
+
+/* The page descriptors live in a fixed table indexed by the page number
+ * within the pool, so neither get_page nor free_page touches libc */
+static kma_page_t page_table[MAXPAGES];
+
+/* Address-ordered bitmap of the free pages that are not on the free
+ * stack. Adjacent set bits form the free ranges that spans are carved
+ * from, so a freed span coalesces with its neighbours just by setting
+ * its bits */
+static unsigned long free_map[MAXPAGES / MAPBITS];
+/* No word of the free map below this one has a bit set */
+static int map_low = MAXPAGES / MAPBITS;
+
+/* Bitmap of the pages that have been used since they were mapped or
+ * last decommitted, and may therefore be resident */
+static unsigned long resident_map[MAXPAGES / MAPBITS];
+
+static chunk_t chunk_table[NUMCHUNKS];
+
+#ifdef KMA_THREADS
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread page_cache_t page_cache;
+/* Flushes the cache of a thread when it exits */
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+#endif
 
 /************Function Prototypes******************************************/
 void* allocPage();
 void freePage(void*);
+void* allocPoolPage();
+void freePoolPage(void*);
+void* allocPages(int);
+void freePages(void*, int);
 void initPages();
+void releasePages();
+
+/* Pop a page off the free stack, or NULL */
+void* popFreePage();
+/* Push the chain of n pages from first to last onto the free stack */
+void pushFreePages(void*, void*, int);
+/* Take the whole free stack, leaving the count to the caller */
+void* takeFreePages();
+/* Move the pages on the free stack into the free map */
+void drainFreePages();
+/* Find the highest run of n free pages in the free map, or -1 */
+int findFreeRun(int);
+/* Find the lowest free page in the free map, or -1 */
+int findFreePage();
+
+/* Account for a page of a chunk being taken or given back */
+void usePage(int);
+void unusePage(int);
+/* Map the lowest unmapped chunk and bump allocate from it */
+void growPool();
+/* Move the never-used pages left to the bump pointer into the free map */
+void retireBump();
+/* Map the highest unmapped chunks that can hold n pages into the free map */
+int growPoolTop(int);
+/* Map and unmap a chunk of the pool */
+void commitChunk(int);
+void releaseChunk(int);
+/* Unmap the chunks that have been idle for long enough */
+void sweepChunks();
+/* Test if an idle chunk has been idle for long enough */
+bool chunkExpired(chunk_t*, int);
+/* Apply the retention policy once no pages are in use */
+void poolEmptied();
+/* Keep the warmest free pages and unmap the chunks without any */
+void keepWarmPages();
+/* Read the wall clock in ms */
+long clockMs();
+/* Map a zeroed block of size bytes into an empty slot of a side table */
+void mapEntries(void**, size_t);
+#ifdef PAGE_DETAILS
+/* Read the wall clock in ns */
+unsigned long long clockNs();
+/* Raise the high-water mark to the pages in use */
+void notePeak();
+/* Count a call that took the given cycles in a latency histogram */
+void noteLatency(unsigned long long*, unsigned long long);
+#endif
+/* Decommit the free pages below the watermark of the free stack */
+void trimFreePages();
+/* Hand a run of free pages in the free map back to the kernel */
+void decommitPages(int, int);
+/* Decommit the highest free pages beyond the watermark */
+void trimFreeMap();
+/* Find the lowest (step 1) or highest (step -1) page taken, or -1 */
+int findUsedPage(int);
+#ifdef KMA_THREADS
+/* Fill an empty page cache with a batch of pages */
+void refillCache(page_cache_t*);
+/* Push the n coldest pages of a page cache onto the free stack */
+void flushCache(page_cache_t*, int);
+void flushCacheAtExit(void*);
+void makeCacheKey();
+#endif
 
 /************External Declaration*****************************************/
 
@@ -75,18 +409,28 @@ void initPages();
 kma_page_t*
 get_page()
 {
-  static int id = 0;
   kma_page_t* res;
+  void* ptr;
+#ifdef PAGE_DETAILS
+  unsigned long long start = CYCLES();
+#endif
+  
+  STAT_ADD(num_requested, 1);
+  STAT_ADD(num_in_use, 1);
   
-  kma_page_stats.num_requested++;
-  kma_page_stats.num_in_use++;
+  ptr = allocPage();
+  assert(ptr != NULL);
   
-  res = (kma_page_t*) malloc(sizeof(kma_page_t));
-  res->id = id++;
+  res = &page_table[PAGE_INDEX(ptr)];
+  res->id = ATOMIC_ADD(next_page_id, 1) - 1;
   res->size = kma_page_stats.page_size;
-  res->ptr = allocPage();
+  res->ptr = ptr;
+  res->tag = NULL;
   
-  assert(res->ptr != NULL);
+#ifdef PAGE_DETAILS
+  notePeak();
+  noteLatency(kma_page_details.get_latency, CYCLES() - start);
+#endif
   
   return res;	
 }
@@ -94,15 +438,121 @@ get_page()
 void
 free_page(kma_page_t* ptr)
 {
+#ifdef PAGE_DETAILS
+  unsigned long long start = CYCLES();
+#endif
+  
   assert(ptr != NULL);
   assert(ptr->ptr != NULL);
-  assert(kma_page_stats.num_in_use > 0);
+  assert(ptr->size == PAGESIZE);
+  assert(ATOMIC_LOAD(kma_page_stats.num_in_use) > 0);
   
-  kma_page_stats.num_freed++;
-  kma_page_stats.num_in_use--;
+  STAT_ADD(num_freed, 1);
+  STAT_ADD(num_in_use, -1);
   
   freePage(ptr->ptr);
-  free(ptr);
+  
+#ifdef PAGE_DETAILS
+  noteLatency(kma_page_details.free_latency, CYCLES() - start);
+#endif
+}
+
+kma_page_t*
+get_pages(int n)
+{
+  kma_page_t* res;
+  void* ptr;
+  int i, index;
+  
+  assert(n > 0);
+  
+  ptr = allocPages(n);
+  if (ptr == NULL)
+    {
+      return NULL;
+    }
+  
+  STAT_ADD(num_requested, n);
+  STAT_ADD(num_in_use, n);
+#ifdef PAGE_DETAILS
+  notePeak();
+#endif
+  
+  index = PAGE_INDEX(ptr);
+  res = &page_table[index];
+  res->id = ATOMIC_ADD(next_page_id, 1) - 1;
+  res->size = n * kma_page_stats.page_size;
+  res->ptr = ptr;
+  res->tag = NULL;
+  
+  /* The descriptors of the trailing pages point back to the first
+   * page, which is how page_lookup finds the span */
+  for (i = 1; i < n; i++)
+    {
+      page_table[index + i] = *res;
+    }
+  
+  return res;
+}
+
+void
+free_pages(kma_page_t* ptr)
+{
+  int n;
+  
+  assert(ptr != NULL);
+  assert(ptr->ptr != NULL);
+  assert(ptr == &page_table[PAGE_INDEX(ptr->ptr)]);
+  
+  n = ptr->size / PAGESIZE;
+  assert(ATOMIC_LOAD(kma_page_stats.num_in_use) >= n);
+  
+  STAT_ADD(num_freed, n);
+  STAT_ADD(num_in_use, -n);
+  
+  freePages(ptr->ptr, n);
+}
+
+kma_page_t*
+page_lookup(void* ptr)
+{
+  kma_page_t* res;
+  int index;
+  
+  assert(pool != NULL);
+  
+  index = PAGE_INDEX(BASEADDR(ptr));
+  assert(index >= 0 && index < MAXPAGES);
+  
+  res = &page_table[index];
+  if (res->ptr != BASEADDR(ptr))
+    {
+      res = &page_table[PAGE_INDEX(res->ptr)];
+    }
+  
+  return res;
+}
+
+void*
+page_entry(kma_side_table_t* table, void* ptr)
+{
+  int index = PAGE_INDEX(BASEADDR(ptr));
+  void** block;
+  
+  assert(index >= 0 && index < MAXPAGES);
+  
+  if (ATOMIC_LOAD(table->blocks) == NULL)
+    {
+      mapEntries((void**)&table->blocks, NUMCHUNKS * sizeof(void*));
+    }
+  
+  block = &table->blocks[CHUNK_INDEX(index)];
+  if (ATOMIC_LOAD(*block) == NULL)
+    {
+      mapEntries(block, CHUNKPAGES * table->entry_size);
+    }
+  
+  return *block + (index % CHUNKPAGES) * table->entry_size;
 }
 
 kma_page_stat_t*
@@ -113,68 +563,1070 @@ page_stats()
   return memcpy(&stats, &kma_page_stats, sizeof(kma_page_stat_t));
 }
 
+kma_page_detail_t*
+page_details()
+{
+  static kma_page_detail_t details;
+  
+  memcpy(&details, &kma_page_details, sizeof(kma_page_detail_t));
+#ifdef PAGE_DETAILS
+  details.enabled = TRUE;
+#endif
+  details.num_rebuilds = kma_page_stats.num_rebuilds;
+  
+  return &details;
+}
+
+int
+page_spread()
+{
+  int low;
+  
+  if (pool == NULL)
+    {
+      return 0;
+    }
+  
+  low = findUsedPage(1);
+  return low < 0 ? 0 : findUsedPage(-1) - low + 1;
+}
+
 void*
 allocPage()
+{
+#ifdef KMA_THREADS
+  page_cache_t* cache = &page_cache;
+  
+  if (cache->count == 0)
+    {
+      refillCache(cache);
+    }
+  
+  return cache->pages[--cache->count];
+#else
+  return allocPoolPage();
+#endif
+}
+
+void
+freePage(void* ptr)
+{
+#ifdef KMA_THREADS
+  page_cache_t* cache = &page_cache;
+  
+  if (cache->count == CACHE_PAGES)
+    {
+      flushCache(cache, CACHE_BATCH);
+    }
+  
+  cache->pages[cache->count++] = ptr;
+#else
+  freePoolPage(ptr);
+#endif
+}
+
+void*
+allocPoolPage()
 {
   void* res;
+  int index;
+  
+  res = popFreePage();
+  if (res != NULL)
+    {
+      usePage(PAGE_INDEX(res));
+      return res;
+    }
+  
+  POOL_LOCK();
   
   if (pool == NULL)
     {
       initPages();
     }
   
-  res = next_free_page;
+  /* Fall back to the lowest free page, which is either left in the free
+   * map, at the bump pointer or at the start of the lowest unmapped
+   * chunk. Going by address keeps the pages handed out from the bottom
+   * contiguous. */
+  index = findFreePage();
+  if (bump < bump_end && (index < 0 || bump < index)
+      && bump < low_chunk * CHUNKPAGES)
+    {
+      index = bump++;
+    }
+  else if (index >= 0 && index < low_chunk * CHUNKPAGES)
+    {
+      CLEAR_FREE(index);
+    }
+  else
+    {
+      growPool();
+      index = bump++;
+    }
+  
+  usePage(index);
+  
+  POOL_UNLOCK();
+  
+  return pool + index * PAGESIZE;
+}
+
+void
+freePoolPage(void* ptr)
+{
+  assert(ptr != NULL);
+  
+#if PAGE_REUSE == REUSE_ADDRESS
+  POOL_LOCK();
+  
+  SET_FREE(PAGE_INDEX(ptr));
+  unusePage(PAGE_INDEX(ptr));
+  
+  if (kma_page_stats.num_resident - ATOMIC_LOAD(kma_page_stats.num_in_use)
+      > DECOMMIT_WATERMARK + DECOMMIT_BATCH)
+    {
+      trimFreeMap();
+    }
+  
+  POOL_UNLOCK();
+#else
+  pushFreePages(ptr, ptr, 1);
+  unusePage(PAGE_INDEX(ptr));
+  
+  if (ATOMIC_LOAD(num_free_pages) > DECOMMIT_WATERMARK + DECOMMIT_BATCH)
+    {
+      trimFreePages();
+    }
+#endif
+  
+#ifndef KMA_THREADS
+  if (kma_page_stats.num_in_use == 0)
+    {
+      poolEmptied();
+    }
+  
+  if (pool != NULL && PAGE_CLOCK() >= next_sweep)
+    {
+      sweepChunks();
+    }
+#endif
+}
+
+void*
+allocPages(int n)
+{
+  int i, index;
+  
+  POOL_LOCK();
+  
+  if (pool == NULL)
+    {
+      initPages();
+    }
+  
+  /* Map more of the top of the pool before falling back to the pages
+   * freed onto the stack or left to the bump pointer, which do not show
+   * up in the free map and sit among the single pages at the bottom */
+  index = findFreeRun(n);
+  if (index < 0 && growPoolTop(n))
+    {
+      index = findFreeRun(n);
+    }
+  
+  if (index < 0 && (num_free_pages > 0 || bump < bump_end))
+    {
+      drainFreePages();
+      retireBump();
+      index = findFreeRun(n);
+    }
+  
+  if (index >= 0)
+    {
+      for (i = index; i < index + n; i++)
+        {
+          CLEAR_FREE(i);
+          usePage(i);
+        }
+    }
+  
+  POOL_UNLOCK();
+  
+  return index < 0 ? NULL : pool + index * PAGESIZE;
+}
+
+void
+freePages(void* ptr, int n)
+{
+  int i, index = PAGE_INDEX(ptr);
+  
+  assert(ptr != NULL);
+  
+  POOL_LOCK();
+  
+  for (i = index; i < index + n; i++)
+    {
+      assert(!TEST_FREE(i));
+      SET_FREE(i);
+      unusePage(i);
+    }
   
+  if (kma_page_stats.num_resident - ATOMIC_LOAD(kma_page_stats.num_in_use)
+      > DECOMMIT_WATERMARK)
+    {
+      decommitPages(index, n);
+    }
+  
+#ifndef KMA_THREADS
+  if (kma_page_stats.num_in_use == 0)
+    {
+      poolEmptied();
+    }
+  
+  if (pool != NULL && PAGE_CLOCK() >= next_sweep)
+    {
+      sweepChunks();
+    }
+#endif
+  
+  POOL_UNLOCK();
+}
+
+void*
+popFreePage()
+{
+  void* res;
+#ifdef KMA_THREADS
+  unsigned long long head, next;
+  void* link;
+  
+  do
+    {
+      head = __atomic_load_n(&free_head, __ATOMIC_ACQUIRE);
+      if (HEAD_PAGE(head) == 0)
+        {
+          return NULL;
+        }
+      
+      /* Another thread may take the page first, leaving a stale link
+       * here, but then the tag has moved on and the swap fails */
+      res = HEAD_PTR(head);
+      link = __atomic_load_n((void**)res, __ATOMIC_RELAXED);
+      next = MAKE_HEAD(HEAD_TAG(head) + 1,
+                       link == NULL ? 0 : PAGE_INDEX(link) + 1);
+    }
+  while (!__sync_bool_compare_and_swap(&free_head, head, next));
+#else
+  res = next_free_page;
   if (res == NULL)
     {
-      error("error: all pages already allocated", "");
+      return NULL;
     }
+  next_free_page = *((void**)res);
+#endif
   
-  next_free_page = *((void**)next_free_page);
+  ATOMIC_ADD(num_free_pages, -1);
+  return res;
+}
+
+void
+pushFreePages(void* first, void* last, int n)
+{
+#ifdef KMA_THREADS
+  unsigned long long head, next;
   
-  assert(res != NULL);
+  do
+    {
+      head = __atomic_load_n(&free_head, __ATOMIC_ACQUIRE);
+      __atomic_store_n((void**)last, HEAD_PTR(head), __ATOMIC_RELAXED);
+      next = MAKE_HEAD(HEAD_TAG(head) + 1, PAGE_INDEX(first) + 1);
+    }
+  while (!__sync_bool_compare_and_swap(&free_head, head, next));
+#else
+  *((void**)last) = next_free_page;
+  next_free_page = first;
+#endif
   
+  ATOMIC_ADD(num_free_pages, n);
+}
+
+void*
+takeFreePages()
+{
+#ifdef KMA_THREADS
+  unsigned long long head;
+  
+  do
+    {
+      head = free_head;
+    }
+  while (!__sync_bool_compare_and_swap(&free_head, head,
+                                       MAKE_HEAD(HEAD_TAG(head) + 1, 0)));
+  
+  return HEAD_PTR(head);
+#else
+  void* res = next_free_page;
+  
+  next_free_page = NULL;
   return res;
+#endif
 }
 
 void
-freePage(void* ptr)
+drainFreePages()
 {
-  assert(ptr != NULL);
+  void* ptr;
+  int n = 0;
+  
+  for (ptr = takeFreePages(); ptr != NULL; ptr = *((void**)ptr))
+    {
+      SET_FREE(PAGE_INDEX(ptr));
+      n++;
+    }
+  
+  ATOMIC_ADD(num_free_pages, -n);
+}
+
+int
+findFreeRun(int n)
+{
+  int i = MAXPAGES - 1;
+  int run = 0;
+  int top = 0;
   
-  *((void**)ptr) = next_free_page;
-  next_free_page = ptr;
+  /* Walk the map from the top of the pool down, so that spans stay out
+   * of the way of the single pages handed out from the bottom */
+  while (i >= 0)
+    {
+      unsigned long word = free_map[i / MAPBITS];
+      
+      if ((i % MAPBITS) == (MAPBITS - 1) && (word == 0 || word == ~0UL))
+        {
+          /* Skip over a whole word that is either all used or all free */
+          if (word == 0)
+            {
+              run = 0;
+            }
+          else
+            {
+              if (run == 0)
+                {
+                  top = i;
+                }
+              run += MAPBITS;
+              if (run >= n)
+                {
+                  return top - n + 1;
+                }
+            }
+          i -= MAPBITS;
+          continue;
+        }
+      
+      if (TEST_FREE(i))
+        {
+          if (run == 0)
+            {
+              top = i;
+            }
+          if (++run == n)
+            {
+              return i;
+            }
+        }
+      else
+        {
+          run = 0;
+        }
+      i--;
+    }
+  
+  return -1;
+}
+
+int
+findFreePage()
+{
+  int i;
+  
+  for (i = map_low; i < MAXPAGES / MAPBITS; i++)
+    {
+      if (free_map[i] != 0)
+        {
+          map_low = i;
+          return i * MAPBITS + __builtin_ctzl(free_map[i]);
+        }
+    }
+  
+  map_low = MAXPAGES / MAPBITS;
+  return -1;
+}
+
+void
+usePage(int index)
+{
+  ATOMIC_ADD(chunk_table[CHUNK_INDEX(index)].in_use, 1);
   
+  if (!TEST_BIT(resident_map, index))
+    {
+      SET_BIT(resident_map, index);
+      STAT_ADD(num_resident, 1);
+    }
+}
+
+void
+unusePage(int index)
+{
+  chunk_t* chunk = &chunk_table[CHUNK_INDEX(index)];
+  
+  assert(ATOMIC_LOAD(chunk->in_use) > 0);
+  
+  if (ATOMIC_ADD(chunk->in_use, -1) == 0)
+    {
+      chunk->idle_since = PAGE_CLOCK();
+#if POOL_RETENTION == POOL_TIMED
+      chunk->idle_time = clockMs();
+#endif
+    }
+}
+
+void
+growPool()
+{
+  int c = low_chunk;
+  
+  if (c == NUMCHUNKS)
+    {
+      error("error: all pages already allocated", "");
+    }
+  
+  commitChunk(c);
+  
+  retireBump();
+  bump = c * CHUNKPAGES;
+  bump_end = bump + CHUNKPAGES;
+}
+
+void
+retireBump()
+{
+  for (; bump < bump_end; bump++)
+    {
+      SET_FREE(bump);
+    }
+  
+  bump = bump_end = 0;
+}
+
+int
+growPoolTop(int n)
+{
+  int c, i, run = 0;
+  int needed = (n + CHUNKPAGES - 1) / CHUNKPAGES;
+  
+  /* Spans are carved from the top, so map from the top down as well */
+  for (c = NUMCHUNKS - 1; c >= 0 && run < needed; c--)
+    {
+      run = chunk_table[c].committed ? 0 : run + 1;
+    }
+  
+  if (run < needed)
+    {
+      return FALSE;
+    }
+  
+  for (c = c + 1; c < NUMCHUNKS && !chunk_table[c].committed; c++)
+    {
+      commitChunk(c);
+      for (i = c * CHUNKPAGES; i < (c + 1) * CHUNKPAGES; i++)
+        {
+          SET_FREE(i);
+        }
+      
+      if (--needed == 0)
+        {
+          break;
+        }
+    }
+  
+  return TRUE;
+}
+
+void
+commitChunk(int c)
+{
+  void* ptr = pool + c * CHUNKSIZE;
+  
+  assert(!chunk_table[c].committed);
+  
+  chunk_table[c].hugetlb = FALSE;
+  
+#if POOL_HUGEPAGE == HUGEPAGE_HUGETLB && defined(MAP_HUGETLB)
+  if (mmap(ptr, CHUNKSIZE, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB, -1, 0)
+      != MAP_FAILED)
+    {
+      chunk_table[c].hugetlb = TRUE;
+    }
+#endif
+  
+  if (!chunk_table[c].hugetlb)
+    {
+      if (mmap(ptr, CHUNKSIZE, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+        {
+          error("error: unable to map a chunk of pages", "");
+        }
+      
+#if POOL_HUGEPAGE != HUGEPAGE_NONE && defined(MADV_HUGEPAGE)
+      /* Only a hint, the chunk just stays on regular pages if the
+       * kernel has no transparent huge pages to give */
+      madvise(ptr, CHUNKSIZE, MADV_HUGEPAGE);
+#endif
+    }
+  
+  chunk_table[c].committed = TRUE;
+  kma_page_stats.num_committed += CHUNKPAGES;
+  chunk_table[c].in_use = 0;
+  chunk_table[c].idle_since = PAGE_CLOCK();
+#if POOL_RETENTION == POOL_TIMED
+  chunk_table[c].idle_time = clockMs();
+#endif
+  
+  while (low_chunk < NUMCHUNKS && chunk_table[low_chunk].committed)
+    {
+      low_chunk++;
+    }
+}
+
+void
+releaseChunk(int c)
+{
+  void* ptr = pool + c * CHUNKSIZE;
+  int i;
+  
+  assert(chunk_table[c].committed);
+  assert(chunk_table[c].in_use == 0);
+  
+  /* Map the chunk back to inaccessible, unbacked address space, which
+   * keeps the range reserved for the pool */
+  if (mmap(ptr, CHUNKSIZE, PROT_NONE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0)
+      == MAP_FAILED)
+    {
+      error("error: unable to unmap a chunk of pages", "");
+    }
+  
+  for (i = c * CHUNKPAGES; i < (c + 1) * CHUNKPAGES; i++)
+    {
+      CLEAR_FREE(i);
+      if (TEST_BIT(resident_map, i))
+        {
+          CLEAR_BIT(resident_map, i);
+          kma_page_stats.num_resident--;
+        }
+    }
+  
+  if (bump >= c * CHUNKPAGES && bump < (c + 1) * CHUNKPAGES)
+    {
+      bump = bump_end = 0;
+    }
+  
+  chunk_table[c].committed = FALSE;
+  kma_page_stats.num_committed -= CHUNKPAGES;
+  
+  if (c < low_chunk)
+    {
+      low_chunk = c;
+    }
+}
+
+void
+sweepChunks()
+{
+  int c, clock = PAGE_CLOCK();
+  bool drained = FALSE;
+  
+  next_sweep = clock + CHUNK_IDLE_TICKS / 4;
+  
+  for (c = 0; c < NUMCHUNKS; c++)
+    {
+      if (chunk_table[c].committed && chunk_table[c].in_use == 0
+          && chunkExpired(&chunk_table[c], clock))
+        {
+          /* The free pages of the chunk may sit anywhere on the free
+           * stack, so move them all into the free map first */
+          if (!drained)
+            {
+              drainFreePages();
+              drained = TRUE;
+            }
+          releaseChunk(c);
+        }
+    }
+  
+#if POOL_RETENTION == POOL_TIMED
+  /* Once every chunk of an empty pool expired, release the pool too */
   if (kma_page_stats.num_in_use == 0)
     {
-      free(pool);
-      pool = NULL;
-      next_free_page = NULL;
+      for (c = 0; c < NUMCHUNKS && !chunk_table[c].committed; c++)
+        ;
+      
+      if (c == NUMCHUNKS)
+        {
+          releasePages();
+        }
     }
+#endif
+}
+
+bool
+chunkExpired(chunk_t* chunk, int clock)
+{
+#if POOL_RETENTION == POOL_TIMED
+  return clockMs() - chunk->idle_time >= POOL_IDLE_MS;
+#else
+  return clock - chunk->idle_since >= CHUNK_IDLE_TICKS;
+#endif
+}
+
+void
+poolEmptied()
+{
+#if POOL_RETENTION == POOL_RELEASE
+  releasePages();
+#elif POOL_RETENTION == POOL_WARM
+  keepWarmPages();
+#elif POOL_RETENTION == POOL_TIMED
+  sweepChunks();
+#endif
 }
 
+void
+keepWarmPages()
+{
+  bool warm[NUMCHUNKS];
+  void* head = takeFreePages();
+  void* ptr = head;
+  void* last = NULL;
+  int c, kept = 0;
+  
+  memset(warm, 0, sizeof(warm));
+  num_free_pages = 0;
+  
+  /* The top of the free stack holds the most recently freed pages */
+  for (; ptr != NULL && kept < POOL_WARM_PAGES; ptr = *((void**)ptr))
+    {
+      warm[CHUNK_INDEX(PAGE_INDEX(ptr))] = TRUE;
+      last = ptr;
+      kept++;
+    }
+  
+  /* Move the rest of the stack into the free map */
+  for (; ptr != NULL; ptr = *((void**)ptr))
+    {
+      SET_FREE(PAGE_INDEX(ptr));
+    }
+  
+  if (last != NULL)
+    {
+      pushFreePages(head, last, kept);
+    }
+  
+  for (c = 0; c < NUMCHUNKS; c++)
+    {
+      if (chunk_table[c].committed && !warm[c])
+        {
+          releaseChunk(c);
+        }
+    }
+}
+
+long
+clockMs()
+{
+  struct timespec now;
+  
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000L + now.tv_nsec / 1000000L;
+}
+
+void
+mapEntries(void** slot, size_t size)
+{
+  void* block = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  
+  if (block == MAP_FAILED)
+    {
+      error("error: unable to map a side table", "");
+    }
+  
+#ifdef KMA_THREADS
+  /* Another thread may have mapped the same entries meanwhile */
+  if (!__sync_bool_compare_and_swap(slot, NULL, block))
+    {
+      munmap(block, size);
+    }
+#else
+  *slot = block;
+#endif
+}
+
+#ifdef PAGE_DETAILS
+unsigned long long
+clockNs()
+{
+  struct timespec now;
+  
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void
+notePeak()
+{
+  int peak, in_use = ATOMIC_LOAD(kma_page_stats.num_in_use);
+  
+#ifdef KMA_THREADS
+  do
+    {
+      peak = ATOMIC_LOAD(kma_page_details.peak_in_use);
+    }
+  while (in_use > peak
+         && !__sync_bool_compare_and_swap(&kma_page_details.peak_in_use,
+                                          peak, in_use));
+#else
+  peak = kma_page_details.peak_in_use;
+  if (in_use > peak)
+    {
+      kma_page_details.peak_in_use = in_use;
+    }
+#endif
+}
+
+void
+noteLatency(unsigned long long* histogram, unsigned long long cycles)
+{
+  int bucket = 63 - __builtin_clzll(cycles | 1);
+  
+  ATOMIC_ADD(histogram[LOWER(bucket, LATENCY_BUCKETS - 1)], 1);
+}
+#endif
+
 void
 initPages()
 {
-  int i;
+  void* res;
+  size_t size = (size_t)MAXPAGES * PAGESIZE;
+  size_t slack;
   
-  assert(next_free_page == NULL);
+  assert(num_free_pages == 0);
   assert(pool == NULL);
   
-  //pool = calloc(MAXPAGES, PAGESIZE);
-  int result = posix_memalign(&pool, PAGESIZE, MAXPAGES * PAGESIZE);
-  if(result)
-    error("Error using posix_memalign to allocate memory", "");
-  next_free_page = pool;
+  if (pool_built)
+    {
+      kma_page_stats.num_rebuilds++;
+    }
+  pool_built = TRUE;
+  
+  /* Reserve the address space for the whole pool without backing it,
+   * so the pool stays contiguous however far it grows. Over-reserve by
+   * a chunk to align the pool to the chunk size. */
+  res = mmap(NULL, size + CHUNKSIZE, PROT_NONE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (res == MAP_FAILED)
+    {
+      error("error: unable to reserve the page pool", "");
+    }
+  
+  slack = CHUNKSIZE - ((unsigned long)res & (CHUNKSIZE - 1));
+  if (slack == CHUNKSIZE)
+    {
+      slack = 0;
+    }
   
-  // use ptr to point to the next free page struct
-  for (i = 0; i < (MAXPAGES - 1); i++)
+  pool = res + slack;
+  if (slack > 0)
     {
-      void* ptr = (pool + i * PAGESIZE);
-      void* next = ptr + PAGESIZE;
+      munmap(res, slack);
+    }
+  munmap(pool + size, CHUNKSIZE - slack);
+  
+  next_sweep = PAGE_CLOCK() + CHUNK_IDLE_TICKS / 4;
+}
+
+void
+releasePages()
+{
+  munmap(pool, (size_t)MAXPAGES * PAGESIZE);
+  pool = NULL;
+  takeFreePages();
+  num_free_pages = 0;
+  bump = bump_end = 0;
+  low_chunk = 0;
+  map_low = MAXPAGES / MAPBITS;
+  memset(free_map, 0, sizeof(free_map));
+  memset(resident_map, 0, sizeof(resident_map));
+  memset(chunk_table, 0, sizeof(chunk_table));
+  kma_page_stats.num_resident = 0;
+  kma_page_stats.num_committed = 0;
+}
+
+void
+trimFreePages()
+{
+  void* head;
+  void* ptr;
+  void* last = NULL;
+  int index, kept = 0, taken = 0, low = 0, high = -1;
+  
+  POOL_LOCK();
+  
+  /* Keep the warmest pages at the top of the stack */
+  head = ptr = takeFreePages();
+  for (; ptr != NULL && kept < DECOMMIT_WATERMARK; ptr = *((void**)ptr))
+    {
+      last = ptr;
+      kept++;
+    }
+  
+  /* Move the colder pages below into the free map, decommitting the runs
+   * of neighbouring pages the stack tends to hold together */
+  for (; ptr != NULL; ptr = *((void**)ptr))
+    {
+      index = PAGE_INDEX(ptr);
+      SET_FREE(index);
+      taken++;
       
-      *((void**) ptr) = next;
+      if (index == high + 1)
+        {
+          high = index;
+        }
+      else if (index == low - 1)
+        {
+          low = index;
+        }
+      else
+        {
+          if (high >= low)
+            {
+              decommitPages(low, high - low + 1);
+            }
+          low = high = index;
+        }
+    }
+  
+  if (high >= low)
+    {
+      decommitPages(low, high - low + 1);
+    }
+  
+  /* Account for every page taken off the stack, then put the kept ones
+   * back */
+  ATOMIC_ADD(num_free_pages, -(kept + taken));
+  if (last != NULL)
+    {
+      pushFreePages(head, last, kept);
+    }
+  
+  POOL_UNLOCK();
+}
+
+void
+decommitPages(int index, int n)
+{
+  int i, end = index + n;
+  int c, run_end;
+  
+  for (; index < end; index = run_end)
+    {
+      /* Hugetlbfs pages cannot be handed back a part at a time */
+      c = CHUNK_INDEX(index);
+      run_end = LOWER(end, (c + 1) * CHUNKPAGES);
+      
+      if (chunk_table[c].hugetlb)
+        {
+          continue;
+        }
+      
+      madvise(pool + index * PAGESIZE, (run_end - index) * PAGESIZE,
+              DECOMMIT_ADVICE);
+      
+      for (i = index; i < run_end; i++)
+        {
+          if (TEST_BIT(resident_map, i))
+            {
+              CLEAR_BIT(resident_map, i);
+              STAT_ADD(num_resident, -1);
+            }
+        }
+    }
+}
+
+void
+trimFreeMap()
+{
+  int i, bit, index, low = 0, high = -1;
+  int excess = kma_page_stats.num_resident
+    - ATOMIC_LOAD(kma_page_stats.num_in_use) - DECOMMIT_WATERMARK;
+  unsigned long word;
+  
+  /* Walk the free resident pages from the top of the pool down */
+  for (i = MAXPAGES / MAPBITS - 1; i >= map_low && excess > 0; i--)
+    {
+      word = free_map[i] & resident_map[i];
+      for (; word != 0 && excess > 0; excess--)
+        {
+          bit = MAPBITS - 1 - __builtin_clzl(word);
+          word &= ~(1UL << bit);
+          index = i * MAPBITS + bit;
+          
+          if (index == low - 1)
+            {
+              low = index;
+            }
+          else
+            {
+              if (high >= low)
+                {
+                  decommitPages(low, high - low + 1);
+                }
+              low = high = index;
+            }
+        }
+    }
+  
+  if (high >= low)
+    {
+      decommitPages(low, high - low + 1);
+    }
+}
+
+int
+findUsedPage(int step)
+{
+  unsigned long stacked[CHUNKPAGES / MAPBITS + 1];
+  void* ptr;
+  int c, i, end;
+  
+  /* The first chunk in that direction with pages taken holds the page */
+  for (c = step > 0 ? 0 : NUMCHUNKS - 1; c >= 0 && c < NUMCHUNKS; c += step)
+    {
+      if (chunk_table[c].committed && chunk_table[c].in_use > 0)
+        {
+          break;
+        }
+    }
+  
+  if (c < 0 || c == NUMCHUNKS)
+    {
+      return -1;
+    }
+  
+  /* The pages of the chunk on the free stack are neither taken nor in
+   * the free map */
+  memset(stacked, 0, sizeof(stacked));
+#ifdef KMA_THREADS
+  ptr = HEAD_PTR(free_head);
+#else
+  ptr = next_free_page;
+#endif
+  for (; ptr != NULL; ptr = *((void**)ptr))
+    {
+      if (CHUNK_INDEX(PAGE_INDEX(ptr)) == c)
+        {
+          SET_BIT(stacked, PAGE_INDEX(ptr) - c * CHUNKPAGES);
+        }
+    }
+  
+  i = step > 0 ? c * CHUNKPAGES : (c + 1) * CHUNKPAGES - 1;
+  for (end = i + step * CHUNKPAGES; i != end; i += step)
+    {
+      if (!TEST_FREE(i) && !TEST_BIT(stacked, i - c * CHUNKPAGES)
+          && (i < bump || i >= bump_end))
+        {
+          return i;
+        }
+    }
+  
+  return -1;
+}
+
+#ifdef KMA_THREADS
+void
+refillCache(page_cache_t* cache)
+{
+  int i;
+  
+  assert(cache->count == 0);
+  
+  if (!cache->registered)
+    {
+      pthread_once(&cache_once, makeCacheKey);
+      pthread_setspecific(cache_key, cache);
+      cache->registered = TRUE;
     }
   
-  *((void**)(pool + (MAXPAGES - 1) * PAGESIZE)) = NULL;
+  /* Hand the pages out in the order they came off the pool */
+  for (i = CACHE_BATCH - 1; i >= 0; i--)
+    {
+      cache->pages[i] = allocPoolPage();
+    }
+  
+  cache->count = CACHE_BATCH;
+}
+
+void
+flushCache(page_cache_t* cache, int n)
+{
+  int i;
+  
+  if (n == 0)
+    {
+      return;
+    }
+  
+#if PAGE_REUSE == REUSE_ADDRESS
+  for (i = 0; i < n; i++)
+    {
+      freePoolPage(cache->pages[i]);
+    }
+#else
+  /* Chain the pages at the bottom of the cache and push them in one go */
+  for (i = 0; i < n - 1; i++)
+    {
+      *((void**)cache->pages[i]) = cache->pages[i + 1];
+    }
+  pushFreePages(cache->pages[0], cache->pages[n - 1], n);
+  
+  /* Only give the pages up after they are on the stack */
+  for (i = 0; i < n; i++)
+    {
+      unusePage(PAGE_INDEX(cache->pages[i]));
+    }
+  
+  if (ATOMIC_LOAD(num_free_pages) > DECOMMIT_WATERMARK + DECOMMIT_BATCH)
+    {
+      trimFreePages();
+    }
+#endif
+  
+  cache->count -= n;
+  memmove(cache->pages, cache->pages + n, cache->count * sizeof(void*));
+}
+
+void
+flushCacheAtExit(void* arg)
+{
+  page_cache_t* cache = arg;
+  
+  flushCache(cache, cache->count);
+}
+
+void
+makeCacheKey()
+{
+  pthread_key_create(&cache_key, flushCacheAtExit);
 }
+#endif
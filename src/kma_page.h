@@ -62,9 +62,22 @@
 #define EXTERN extern
 #endif
 
+/* The page size, a power of two no smaller than the page size of the
+ * host. It can be set at build time, e.g. KMAFLAGS="-DPAGESIZE=16384",
+ * and every allocator sizes its structures from it. */
+#ifndef PAGESIZE
 #define PAGESIZE 8192
+#endif
+
+#if PAGESIZE & (PAGESIZE - 1)
+#error "PAGESIZE must be a power of two"
+#endif
 
-#define MAXPAGES 4096
+/* The ceiling on the number of pages in the pool. Only the address
+ * space is reserved up front, pages are mapped as the pool grows. */
+#ifndef MAXPAGES
+#define MAXPAGES 65536
+#endif
 
 /***********************************************************************
  *  Title: Base Address Macro
@@ -76,21 +89,70 @@
  ***********************************************************************/
 #define BASEADDR(x) ((void*)(((long) (x)) & ~(PAGESIZE-1)))
 
+/***********************************************************************
+ *  Title: Number of Pages Macro
+ * ---------------------------------------------------------------------
+ *    Purpose: Get the number of pages needed to hold a size
+ *    Input: size in bytes
+ *    Output: the number of pages
+ ***********************************************************************/
+#define NUMPAGES(x) (((x) + PAGESIZE - 1) / PAGESIZE)
+
+/* A page or span of pages. The tag is free for the allocator that owns
+ * the page, which page_lookup hands back along with the page, and is
+ * NULL when the page is handed out. */
 typedef struct
 {
   int id;
   void* ptr;
   int size;
+  void* tag;
 } kma_page_t;
 
+/* A table of per page data that an allocator keeps outside its pages,
+ * with an entry of entry_size bytes for every page of the pool. Only
+ * the blocks of entries covering the chunks in use are mapped. */
+typedef struct
+{
+  int entry_size;
+  void** blocks;
+} kma_side_table_t;
+
+/***********************************************************************
+ *  Title: Side Table Initializer Macro
+ * ---------------------------------------------------------------------
+ *    Purpose: Initialize an empty side table
+ *    Input: the type of an entry
+ *    Output: the initializer of the table
+ ***********************************************************************/
+#define SIDE_TABLE(type) { sizeof(type), NULL }
+
 typedef struct
 {
   int num_requested;
   int num_freed;
   int num_in_use;
   int page_size;
+  int num_rebuilds;
+  int num_resident;
+  int num_committed;
 } kma_page_stat_t;
 
+/* The number of buckets in a latency histogram. Bucket i counts the
+ * calls that took [2^i, 2^(i+1)) cycles, the last one everything
+ * slower. */
+#define LATENCY_BUCKETS 32
+
+/* Detailed statistics, only collected when built with PAGE_DETAILS */
+typedef struct
+{
+  int enabled;
+  int peak_in_use;
+  int num_rebuilds;
+  unsigned long long get_latency[LATENCY_BUCKETS];
+  unsigned long long free_latency[LATENCY_BUCKETS];
+} kma_page_detail_t;
+
 /************Global Variables*********************************************/
 
 /************Function Prototypes******************************************/
@@ -113,6 +175,51 @@ EXTERN kma_page_t* get_page();
  ***********************************************************************/
 EXTERN void free_page(kma_page_t*);
 
+/***********************************************************************
+ *  Title: Allocates contiguous memory pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Allocates a span of n physically contiguous memory
+ *             pages, described by a single page structure whose
+ *             size covers the whole span
+ *    Input: the number of pages
+ *    Output: the allocated span or NULL if no free range is large
+ *            enough
+ ***********************************************************************/
+EXTERN kma_page_t* get_pages(int);
+
+/***********************************************************************
+ *  Title: Releases contiguous memory pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Releases a span of memory pages, coalescing it with
+ *             the free ranges around it
+ *    Input: the pointer to the span structure
+ *    Output: none
+ ***********************************************************************/
+EXTERN void free_pages(kma_page_t*);
+
+/***********************************************************************
+ *  Title: Looks up the page of an address
+ * ---------------------------------------------------------------------
+ *    Purpose: Finds the memory page structure of the page holding
+ *             the given address in constant time, through a directory
+ *             indexed by page number. Any address within a span
+ *             yields the structure of the span.
+ *    Input: a pointer into an allocated memory page
+ *    Output: the memory page structure of that page
+ ***********************************************************************/
+EXTERN kma_page_t* page_lookup(void*);
+
+/***********************************************************************
+ *  Title: Looks up the side table entry of an address
+ * ---------------------------------------------------------------------
+ *    Purpose: Finds the entry of the page holding the given address
+ *             in a side table. The entries of a chunk of pages are
+ *             mapped, zeroed, the first time one of them is looked up.
+ *    Input: the side table and a pointer into a memory page
+ *    Output: the entry of that page
+ ***********************************************************************/
+EXTERN void* page_entry(kma_side_table_t*, void*);
+
 /***********************************************************************
  *  Title: Memory page statistics
  * ---------------------------------------------------------------------
@@ -122,6 +229,29 @@ EXTERN void free_page(kma_page_t*);
  ***********************************************************************/
 EXTERN kma_page_stat_t* page_stats();
 
+/***********************************************************************
+ *  Title: Detailed memory page statistics
+ * ---------------------------------------------------------------------
+ *    Purpose: Get the high-water mark of the pages in use, the number
+ *             of pool rebuilds and the get_page/free_page latency
+ *             histograms. Without PAGE_DETAILS only the rebuilds are
+ *             filled in and enabled is FALSE.
+ *    Input: none
+ *    Output: the detailed statistics in a static buffer
+ ***********************************************************************/
+EXTERN kma_page_detail_t* page_details();
+
+/***********************************************************************
+ *  Title: Spread of the memory pages in use
+ * ---------------------------------------------------------------------
+ *    Purpose: Get the number of pages from the lowest to the highest
+ *             page in use, which is as low as the number of pages in
+ *             use when they are packed together
+ *    Input: none
+ *    Output: the number of pages spanned, or 0 if none are in use
+ ***********************************************************************/
+EXTERN int page_spread();
+
 /************External Declaration*****************************************/
 
 /**************Definition***************************************************/
@@ -58,7 +58,6 @@ typedef struct
 
 typedef struct 
 {
-  void* this;
   int page_counter;
   int buffer_counter;
   void* first_free_buffer;
@@ -168,9 +167,11 @@ remove_buffer(void* buffer)
 void*
 kma_malloc(kma_size_t size)
 {
-  /* If the request size is too large, return NULL */
-  if ((size + sizeof(void *)) > PAGESIZE) {
-    return NULL;
+  /* If the request does not fit next to the page header, serve it from
+   * a span of pages */
+  if ((size + sizeof(page_header_t)) > PAGESIZE) {
+    kma_page_t* span = get_pages(NUMPAGES(size));
+    return span == NULL ? NULL : span->ptr;
   }    
 
   /* Initialize the global entry if not exist */
@@ -193,9 +194,7 @@ kma_malloc(kma_size_t size)
 
 void
 init_page_header(kma_page_t *page) {
-  /* Set up the pointer to the current page */
   page_header_t *pagehead;
-  *((kma_page_t**) page->ptr) = page;
 
   /* Set up the counters */
   pagehead = (page_header_t*) (page->ptr);
@@ -251,6 +250,12 @@ find_buffer(int size) {
 void
 kma_free(void* ptr, kma_size_t size)
 {
+  /* Spans go straight back to the page allocator */
+  if ((size + sizeof(page_header_t)) > PAGESIZE) {
+    free_pages(page_lookup(ptr));
+    return;
+  }
+
   /* Add the given buffer to the free list */
   add_buffer(ptr, size);
   page_header_t* base_addr = BASEADDR(ptr);
@@ -286,7 +291,7 @@ kma_free(void* ptr, kma_size_t size)
       kma_page_entry = NULL;
     }
 
-    free_page(last_page->this);
+    free_page(page_lookup(last_page));
 
     /* If this is not the first page, just decrement the number of pages */
     if(kma_page_entry != NULL)
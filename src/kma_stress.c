@@ -0,0 +1,251 @@
+/***************************************************************************
+ *  Title: Page Allocator Stress Test
+ * -------------------------------------------------------------------------
+ *    Purpose: Multi-threaded stress test for the kernel page allocator
+ *    Author: Stefan Birrer
+ *    Copyright: 2004 Northwestern University
+ ***************************************************************************/
+/***************************************************************************
+ *  ChangeLog:
+ * -------------------------------------------------------------------------
+ *    Revision 1.1  2026/10/17
+ *    - initial version, built with make stress
+ *
+ ***************************************************************************/
+#define __KMA_STRESS_IMPL__
+
+/************System include***********************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+/************Private include**********************************************/
+#include "kma_page.h"
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+#ifndef NUMTHREADS
+#define NUMTHREADS 8
+#endif
+
+#ifndef NUMROUNDS
+#define NUMROUNDS 200000
+#endif
+
+/* The number of pages or spans each thread holds at most */
+#define NUMSLOTS 64
+
+/* The largest span a thread asks for */
+#define MAXSPAN 8
+
+/* The stamp written into an allocation, unique to a thread and slot */
+#define STAMP(t, s) ((long)(t) * NUMSLOTS + (s) + 1)
+
+typedef struct
+{
+  int id;
+  unsigned int seed;
+  int num_pages;
+  kma_page_t* slots[NUMSLOTS];
+} worker_t;
+
+/************Global Variables*********************************************/
+
+static worker_t gWorkers[NUMTHREADS];
+
+/* Pages handed between threads, so that they are freed elsewhere */
+static kma_page_t* volatile gMailbox[NUMTHREADS];
+
+static int gFailures = 0;
+
+/************Function Prototypes******************************************/
+void* work(void*);
+void stamp(kma_page_t*, long);
+void verify(kma_page_t*, long);
+void release(kma_page_t*);
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+int
+main(int argc, char* argv[])
+{
+  pthread_t threads[NUMTHREADS];
+  kma_page_stat_t* stat;
+  int i, s, requested = 0;
+
+  for (i = 0; i < NUMTHREADS; i++)
+    {
+      gWorkers[i].id = i;
+      gWorkers[i].seed = i + 1;
+      if (pthread_create(&threads[i], NULL, work, &gWorkers[i]) != 0)
+        {
+          error("unable to start a thread", "");
+        }
+    }
+
+  for (i = 0; i < NUMTHREADS; i++)
+    {
+      pthread_join(threads[i], NULL);
+      requested += gWorkers[i].num_pages;
+    }
+
+  /* Hand back what the threads left behind */
+  for (i = 0; i < NUMTHREADS; i++)
+    {
+      for (s = 0; s < NUMSLOTS; s++)
+        {
+          if (gWorkers[i].slots[s] != NULL)
+            {
+              verify(gWorkers[i].slots[s], STAMP(i, s));
+              release(gWorkers[i].slots[s]);
+            }
+        }
+      if (gMailbox[i] != NULL)
+        {
+          release(gMailbox[i]);
+        }
+    }
+
+  stat = page_stats();
+
+  printf("Page Requested/Freed/In Use: %5d/%5d/%5d\n",
+         stat->num_requested, stat->num_freed, stat->num_in_use);
+  printf("Page Resident/Committed: %5d/%5d\n",
+         stat->num_resident, stat->num_committed);
+
+  if (stat->num_requested != requested)
+    {
+      printf("Requested %d pages, but the allocator counted %d\n",
+             requested, stat->num_requested);
+      gFailures++;
+    }
+  if (stat->num_freed != stat->num_requested || stat->num_in_use != 0)
+    {
+      printf("Pages still in use after every page was freed\n");
+      gFailures++;
+    }
+  if (stat->num_resident < 0 || stat->num_resident > stat->num_committed
+      || stat->num_committed > MAXPAGES)
+    {
+      printf("Resident pages out of range\n");
+      gFailures++;
+    }
+
+  if (gFailures > 0)
+    {
+      printf("Stress: FAIL\n");
+      return EXIT_FAILURE;
+    }
+
+  printf("Stress: PASS\n");
+  return EXIT_SUCCESS;
+}
+
+void*
+work(void* arg)
+{
+  worker_t* self = arg;
+  kma_page_t* page;
+  int round, s, n;
+
+  for (round = 0; round < NUMROUNDS; round++)
+    {
+      s = rand_r(&self->seed) % NUMSLOTS;
+      page = self->slots[s];
+
+      if (page != NULL)
+        {
+          verify(page, STAMP(self->id, s));
+          self->slots[s] = NULL;
+
+          /* Now and then leave the page to the next thread to free */
+          if (rand_r(&self->seed) % 8 == 0)
+            {
+              stamp(page, 0);
+              page = __sync_lock_test_and_set(
+                &gMailbox[(self->id + 1) % NUMTHREADS], page);
+              if (page == NULL)
+                {
+                  continue;
+                }
+              verify(page, 0);
+            }
+          release(page);
+          continue;
+        }
+
+      if (rand_r(&self->seed) % 16 == 0)
+        {
+          n = 2 + rand_r(&self->seed) % (MAXSPAN - 1);
+          page = get_pages(n);
+          if (page == NULL)
+            {
+              continue;
+            }
+        }
+      else
+        {
+          n = 1;
+          page = get_page();
+        }
+
+      self->num_pages += n;
+      stamp(page, STAMP(self->id, s));
+      self->slots[s] = page;
+    }
+
+  return NULL;
+}
+
+void
+stamp(kma_page_t* page, long value)
+{
+  long* words = page->ptr;
+  int n = page->size / sizeof(long);
+
+  /* The first word of a free page holds its link, so an allocation
+   * handed to two threads at once shows up in either word */
+  words[0] = value;
+  words[n - 1] = value;
+}
+
+void
+verify(kma_page_t* page, long value)
+{
+  long* words = page->ptr;
+  int n = page->size / sizeof(long);
+
+  if (words[0] != value || words[n - 1] != value)
+    {
+      printf("Page %d overwritten while in use\n", page->id);
+      __sync_fetch_and_add(&gFailures, 1);
+    }
+}
+
+void
+release(kma_page_t* page)
+{
+  if (page->size > PAGESIZE)
+    {
+      free_pages(page);
+    }
+  else
+    {
+      free_page(page);
+    }
+}
+
+void
+error(char* message, char* arg)
+{
+  fprintf(stderr, "ERROR: %s: %s.\n", message, arg);
+  exit(EXIT_FAILURE);
+}